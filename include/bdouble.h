@@ -7,6 +7,10 @@
 #define __ddouble__bdouble__
 
 #include <vector>
+#include <cmath>
+#include <utility>
+#include <string>
+#include "chunkedVector.h"
 using namespace std;
 
 const size_t
@@ -15,7 +19,48 @@ bplusv = 5, bminusv = 6, bmultv = 7, sumconstv = 8, minusconstv = 9, multconstv
 cosv = 11, sinv = 12, expv = 13, exp2v = 14, expm1v = 15, powv = 16, powintv = 17, invv = 18,
 logv = 19, log10v = 20, log2v = 21, coshv = 22, sinhv = 23, erfv = 24, erfcv = 25, nv= 26,
 tanv = 27, tanhv = 28, acosv = 29, asinv = 30, atanv = 31, acoshv = 32, asinhv = 33, atanhv = 34,
-lgammav = 35, tgammav = 36, log1pv = 37;
+lgammav = 35, tgammav = 36, log1pv = 37, npdfv = 38, blackscholesv = 39, lognpdfv = 40,
+atan2v = 41, hypotv = 42, fmav = 43, powbasev = 44, powbv = 45, fabsv = 46, fmaxv = 47, fminv = 48,
+fmaxconstv = 49, fminconstv = 50, selectv = 51, smoothabsv = 52;
+
+//number of opcodes
+const size_t opcount = 53;
+
+//scalar used by the taylor expansion kernels and by the
+//higher order accumulation in run_tape. The tape itself
+//always stores doubles.
+#ifdef ADHOC_EXTENDED_KERNELS
+typedef long double kdouble;
+#else
+typedef double kdouble;
+#endif
+
+//size of a recorded tape. tape_stats() after a run gives
+//what reserve_tape needs to record the same run again
+struct tapeStats
+{
+    size_t ops;
+    size_t indices;
+    size_t values;
+    size_t ids;
+    //memory taken by the three traces
+    size_t bytes;
+    //ops recorded for each opcode
+    vector<size_t> op_counts;
+    //most variables alive at once in the last run_tape
+    size_t max_nvar;
+};
+
+//sizes of the tape at some point of the recording
+struct tapePosition
+{
+    size_t ops;
+    size_t indices;
+    size_t values;
+    size_t ids;
+    //tape the position was taken on, changed by every clear
+    size_t generation;
+};
 
 class bdouble
 {
@@ -133,23 +178,31 @@ public:
     bdouble operator*(const T& rhs) const
     {
         //if T is 1 then this is identity
-        if(rhs != 1)
-        {
-            const bdouble& in = (*this);
-            
-            bdouble::val_trace.push_back((double)rhs);
-            bdouble::val_trace.push_back((double)rhs * in.mValue);
-            
-            bdouble res(bdouble::val_trace.back());
-            
-            bdouble::op_trace.push_back(multconstv);
-            bdouble::index_trace.push_back(in.mThisId);
-            bdouble::index_trace.push_back(res.mThisId);
-            
-            return res;
-        }
-        else
+        if(rhs == 1)
             return *this;
+        
+        //if T is 0 then the result doesn't depend on this
+        if(rhs == 0)
+            return bdouble((double)rhs * mValue);
+        
+        const bdouble& in = (*this);
+        
+        //x*a*b is recorded as x*(a*b)
+        size_t arg = in.mThisId;
+        double factor = (double)rhs;
+        if(last_op(multconstv,in.mThisId,arg))
+            factor *= bdouble::val_trace[bdouble::val_trace.size()-2];
+        
+        bdouble::val_trace.push_back(factor);
+        bdouble::val_trace.push_back((double)rhs * in.mValue);
+        
+        bdouble res(bdouble::val_trace.back());
+        
+        bdouble::op_trace.push_back(multconstv);
+        bdouble::index_trace.push_back(arg);
+        bdouble::index_trace.push_back(res.mThisId);
+        
+        return res;
     }
     
     template <class T>
@@ -191,12 +244,29 @@ public:
     friend bdouble lgamma(const bdouble& in);
     friend bdouble tgamma(const bdouble& in);
     friend bdouble ldexp(const bdouble& in, const int& exp);
+    friend bdouble fabs(const bdouble& in);
+    friend bdouble abs(const bdouble& in);
     
     friend bdouble pow(const bdouble& in, const int& deg);
     friend bdouble pow(const bdouble& in, const double& deg);
     friend bdouble pow(const double& val, const bdouble& in);
     friend bdouble pow(const bdouble& val, const bdouble& in);
     
+    friend bdouble hypot(const bdouble& arg1, const bdouble& arg2);
+    friend bdouble atan2(const bdouble& arg1, const bdouble& arg2);
+    friend bdouble fma(const bdouble& arg1, const bdouble& arg2, const bdouble& arg3);
+    
+    //kinks are recorded as ops so that the branch taken
+    //lives on the tape, ties go to the first argument
+    friend bdouble fmax(const bdouble& arg1, const bdouble& arg2);
+    friend bdouble fmin(const bdouble& arg1, const bdouble& arg2);
+    friend bdouble fmax(const bdouble& arg1, const double& arg2);
+    friend bdouble fmin(const bdouble& arg1, const double& arg2);
+    friend bdouble fmax(const double& arg1, const bdouble& arg2);
+    friend bdouble fmin(const double& arg1, const bdouble& arg2);
+    
+    //when some arguments are constants we record
+    //the ops on the bdouble arguments only
     template <class T,class U>
     friend bdouble hypot(const T& arg1, const U& arg2)
     {
@@ -206,7 +276,11 @@ public:
     template <class T,class U>
     friend bdouble atan2(const T& arg1, const U& arg2)
     {
-        return atan(arg1/arg2);
+        //atan only covers two quadrants, the
+        //difference with atan2 is a constant
+        double value1 = arg1;
+        double value2 = arg2;
+        return atan(arg1/arg2) + (std::atan2(value1,value2) - std::atan(value1/value2));
     }
     
     template <class T,class U,class V>
@@ -217,15 +291,139 @@ public:
     
     //non-standard functions
     friend bdouble N(const bdouble& in);
+    friend bdouble npdf(const bdouble& in);
     friend bdouble inv(const bdouble& in);
     
+    //cond > 0 ? arg1 : arg2, with no derivative in cond
+    friend bdouble select(const bdouble& cond, const bdouble& arg1, const bdouble& arg2);
+    
+    //smoothed kinks of width eps, fabs becomes
+    //sqrt(x^2 + eps^2) and select blends its
+    //arguments with N(cond/eps)
+    friend bdouble smoothabs(const bdouble& in, const double& eps);
+    friend bdouble smoothmax(const bdouble& arg1, const bdouble& arg2, const double& eps);
+    friend bdouble smoothmin(const bdouble& arg1, const bdouble& arg2, const double& eps);
+    friend bdouble smoothselect(const bdouble& cond, const bdouble& arg1, const bdouble& arg2, const double& eps);
+    
+    //fused finance functions, recorded as a single op.
+    //constant arguments are better passed as bdoubles
+    //created once as each conversion creates a new id.
+    
+    //undiscounted black-scholes call on a forward:
+    //F N(d1) - K N(d2)
+    friend bdouble blackscholes(const bdouble& F, const bdouble& K, const bdouble& sigma, const bdouble& T);
+    //density of a lognormal variable with log-mean mu
+    //and log-volatility sigma
+    friend bdouble lognpdf(const bdouble& x, const bdouble& mu, const bdouble& sigma);
+    
+    //bulk derivatives with respect to vars, computed on the
+    //first call like der. the order k tensor holds one value per
+    //multiset of k variables, in the order of
+    //multisetGenerator(vars.size(),k): for the hessian this is
+    //the upper triangle row by row (0,0),(0,1),...,(1,1),...
+    //an order above the one run throws invalid_argument.
+    vector<double> tensor(const vector<bdouble>& vars,const size_t& order);
+    vector<double> gradient(const vector<bdouble>& vars) {return tensor(vars,1);}
+    vector<double> hessian(const vector<bdouble>& vars) {return tensor(vars,2);}
+    
+    //read only views of the result of run_tape, empty before.
+    //slot i is the variable ids()[i] and the derivative where
+    //idxes[i+1] is the power of slot i and idxes[0] is order()
+    //minus the total power is coeffs()[multisetcount(idxes,order())]
+    const vector<double>& coeffs() const {return mCoeff;}
+    const vector<size_t>& ids() const {return mId;}
+    const size_t& order() const {return mOrder;}
+    
+    //ids that are not results of ops and this depends on, sorted.
+    //only walks the tape, nothing is allocated for the derivatives
+    vector<size_t> dependencies() const;
+    //same, interactions gets the pairs (i,j) i <= j of those ids
+    //whose second derivative may be nonzero, sorted
+    vector<size_t> dependencies(vector<pair<size_t,size_t> >& interactions) const;
+    
     const size_t& id() const {return mThisId;}
     operator double() const {return mValue;}
     
     static void setOrder(size_t order) {mDefaultOrder = order;}
     void run_tape(const size_t orderOverride = -1);
+    //the tape memory is kept for the next recording,
+    //release_tape gives it back
     static void clear_tape();
-    
+    static void release_tape();
+    
+    //rewind_tape goes back to a position, dropping what was recorded
+    //since. variables from before the position stay valid, the ones
+    //created after it must not be used anymore. positions are
+    //invalidated by clear_tape, release_tape and the calls that
+    //replace the tape (optimize_tape, load_tape, map_tape), rewinding
+    //to them throws invalid_argument.
+    static tapePosition tape_position();
+    static void rewind_tape(const tapePosition& position);
+    
+    //rewrites the tape keeping only the ops vars depend on, with
+    //chains of sumconst, minusconst and multconst folded into one
+    //op, repeated ops on the same arguments and constants merged
+    //and ids renumbered densely. vars get their new ids, every
+    //other bdouble and tape position is invalid afterwards.
+    static void optimize_tape(vector<bdouble>& vars);
+    
+    //records the tape from now on in the files path.ops, path.idx
+    //and path.val mapped in memory, for tapes that don't fit in
+    //RAM. the current tape is dropped, release_tape goes back to
+    //memory and leaves the files on disk. throws system_error when
+    //a file can't be created or mapped.
+    static void map_tape(const string& path);
+    
+    //writes the tape and vars to path in a versioned binary format
+    static void save_tape(const string& path,const vector<bdouble>& vars);
+    //replaces the tape by the one saved at path and gives back the
+    //vars saved with it. with map the file is mapped and the tape
+    //is read from it in place until the next clear_tape. a file
+    //that can't be read or doesn't hold a valid tape throws
+    //runtime_error and leaves the tape empty.
+    static vector<bdouble> load_tape(const string& path,const bool& map = false);
+    
+    //keeps the full chunks of the tape packed in memory from now
+    //on, they are unpacked one at a time when the tape is read.
+    //trades some work in the sweeps for memory bandwidth. a tape
+    //mapped by map_tape can't be packed, that throws logic_error.
+    static void pack_tape(const bool& on);
+    
+    //allocates the tape up front so that recording doesn't grow it
+    static void reserve_tape(const size_t& ops,const size_t& indices,const size_t& values);
+    static void reserve_tape(const tapeStats& stats) {reserve_tape(stats.ops,stats.indices,stats.values);}
+    static tapeStats tape_stats();
+    
+    //first order derivatives of sum_j weights[j] outputs[j] with
+    //respect to every variable, in one reverse sweep of the whole
+    //tape. res is indexed by id, ids that are results of ops are 0.
+    static void adjoints(const vector<bdouble>& outputs,const vector<double>& weights,vector<double>& res);
+    //same, only sweeping the ops recorded after position. the
+    //adjoints stop on the ids from before it.
+    static void adjoints(const tapePosition& position,const vector<bdouble>& outputs,const vector<double>& weights,vector<double>& res);
+    //same, streaming (id, adjoint) for each variable that the
+    //outputs depend on from inside the sweep, as soon as the ops
+    //left can't reach it, so by decreasing id. data is passed
+    //along to callback.
+    static void adjoints(const vector<bdouble>& outputs,const vector<double>& weights,void (*callback)(const size_t& id,const double& adjoint,void* data),void* data = 0);
+    
+    //indices in vars of the variables each output depends on,
+    //found in one forward pass over the tape. vars should not
+    //be results of ops.
+    static void sparsity_pattern(const vector<bdouble>& outputs,const vector<bdouble>& vars,vector<vector<size_t> >& pattern);
+    //greedy colouring of the rows of pattern so that rows sharing
+    //a column get different colours, returns the number of colours
+    static size_t row_colouring(const vector<vector<size_t> >& pattern,const size_t& ncols,vector<size_t>& colours);
+    //jacobian of outputs with respect to vars as (row, col, value)
+    //triplets in row order, one adjoint sweep per row colour
+    static void sparse_jacobian(const vector<bdouble>& outputs,const vector<bdouble>& vars,vector<size_t>& rows,vector<size_t>& cols,vector<double>& values);
+    
+    //memory taken by a run of the given order where nvar
+    //variables are alive at once, false if it doesn't fit
+    //in a size_t. the estimate never overflows.
+    static bool coeff_memory(const size_t& nvar,const size_t& order,size_t& bytes);
+    static double coeff_memory_estimate(const size_t& nvar,const size_t& order);
+
 private:
     
     double mValue;
@@ -237,46 +435,63 @@ private:
     
     //default order calculations
     static size_t mDefaultOrder;
+    //live variables peak of the last run_tape
+    static size_t mLastMaxNvar;
     
     //tape
-    static vector<size_t> op_trace;
-    static vector<size_t> index_trace;
-    static vector<double> val_trace;
+    static chunkedVector<size_t> op_trace;
+    static chunkedVector<size_t> index_trace;
+    static chunkedVector<double> val_trace;
     static size_t indexcount;
+    //ops before this one are never simplified away, a position
+    //was taken after them
+    static size_t mFoldFloor;
+    //tape of the positions that can be rewound to
+    static size_t mTapeGeneration;
+    
+    //saved tape mapped by load_tape
+    static void* mTapeFile;
+    static size_t mTapeFileBytes;
+    static void unmap_tape_file();
+    
+    //marks the ops and ids id depends on, as the first pass
+    //of run_tape
+    static void relevant_ops(const size_t& id,vector<bool>& op_relevant,vector<bool>& var_concerned);
+    //same pass, visitor.result(res) is called for each relevant op
+    //and then visitor.argument(arg) for each of its arguments
+    template<class Visitor>
+    static void relevant_ops(const size_t& id,vector<bool>& op_relevant,vector<bool>& var_concerned,Visitor& visitor);
+    
+    //weighted first order reverse sweep, touched flags the
+    //ids the outputs depend on. with reached the buffers are
+    //reused: they come in clean and reached gets every id
+    //flagged, for the caller to clean them up. with callback the
+    //variables are streamed as they are done.
+    static void adjoint_sweep(const vector<bdouble>& outputs,const vector<double>& weights,vector<double>& adj,vector<bool>& touched,const size_t& first_op = 0,vector<size_t>* reached = 0,void (*callback)(const size_t& id,const double& adjoint,void* data) = 0,void* data = 0);
+    
+    friend class tapePrefix;
+    
+    //a bdouble for an id already on the tape
+    bdouble(const double& value, const size_t& id);
+    
+    //true if the last op recorded is op giving id and it's past
+    //the last tape position, arg is then set to its argument
+    static bool last_op(const size_t& op, const size_t& id, size_t& arg)
+    {
+        if(op_trace.size() <= mFoldFloor || op_trace[op_trace.size()-1] != op || index_trace[index_trace.size()-1] != id)
+            return false;
+        
+        arg = index_trace[index_trace.size()-2];
+        return true;
+    }
+    
+    //records an op of several arguments
+    static bdouble record_nary(const size_t& op, const vector<bdouble>& args, const double& value);
     
     //accesing mCoeff data
     const double& get(const vector<size_t>& idxes) const;
     double& get(const vector<size_t>& idxes);
     
-    //functions to calculate taylor expansions
-    friend void TE_multconst(const double& value,const double& coeff,vector<double>& output,size_t loc);
-    friend void TE_sumconst(const double& value,const double& coeff,vector<double>& output,size_t loc);
-    friend void TE_cos(const double& value,vector<double>& output,size_t loc);
-    friend void TE_sin(const double& value,vector<double>& output,size_t loc);
-    friend void TE_exp(const double& value,vector<double>& output,size_t loc);
-    friend void TE_exp2(const double& value,vector<double>& output,size_t loc);
-    friend void TE_expm1(const double& value,vector<double>& output,size_t loc);
-    friend void TE_pow(const double& value,const double& deg,vector<double>& output,size_t loc);
-    friend void TE_log(const double& value,vector<double>& output,size_t loc);
-    friend void TE_log1p(const double& value,vector<double>& output,size_t loc);
-    friend void TE_log10(const double& value,vector<double>& output,size_t loc);
-    friend void TE_log2(const double& value,vector<double>& output,size_t loc);
-    friend void TE_cosh(const double& value,vector<double>& output,size_t loc);
-    friend void TE_sinh(const double& value,vector<double>& output,size_t loc);
-    friend void TE_erf(const double& value,vector<double>& output,size_t loc);
-    friend void TE_erfc(const double& value,vector<double>& output,size_t loc);
-    friend void TE_N(const double& value,vector<double>& output,size_t loc);
-    friend void TE_tan(const double& value,vector<double>& output,size_t loc);
-    friend void TE_tanh(const double& value,vector<double>& output,size_t loc);
-    friend void TE_acos(const double& value,vector<double>& output,size_t loc);
-    friend void TE_asin(const double& value,vector<double>& output,size_t loc);
-    friend void TE_atan(const double& value,vector<double>& output,size_t loc);
-    friend void TE_acosh(const double& value,vector<double>& output,size_t loc);
-    friend void TE_asinh(const double& value,vector<double>& output,size_t loc);
-    friend void TE_atanh(const double& value,vector<double>& output,size_t loc);
-    friend void TE_lgamma(const double& value,vector<double>& output,size_t loc);
-    friend void TE_tgamma(const double& value,vector<double>& output,size_t loc);
-    
     //aux
     template<typename ... Types>
     double der_aux(size_t& var_id, vector<size_t>& idxes,const size_t& order,const Types & ... rest) const
@@ -311,4 +526,39 @@ private:
     bool addDer(vector<size_t>& idxes,const size_t& var_id,const size_t& order) const;
 };
 
+//a part of the tape recorded once and shared by many later
+//computations, like curve nodes built from market quotes. the
+//jacobian of the nodes with respect to the quotes is computed
+//once, then each gradient only sweeps the tape recorded after
+//the prefix and goes on through the jacobian. what is recorded
+//after the prefix should only use the nodes and the quotes.
+class tapePrefix
+{
+public:
+    tapePrefix(const vector<bdouble>& nodes,const vector<bdouble>& quotes);
+    
+    //first order derivatives of sum_j weights[j] outputs[j]
+    //with respect to the quotes
+    vector<double> gradient(const vector<bdouble>& outputs,const vector<double>& weights) const;
+    vector<double> gradient(const bdouble& output) const {return gradient(vector<bdouble>(1,output),vector<double>(1,1.0));}
+    
+    const tapePosition& position() const {return mPosition;}
+
+private:
+    tapePosition mPosition;
+    vector<bdouble> mNodes;
+    vector<bdouble> mQuotes;
+    
+    //sparse jacobian, row i is in [mRowStart[i],mRowStart[i+1])
+    vector<size_t> mRowStart;
+    vector<size_t> mCols;
+    vector<double> mValues;
+    
+    //adjoint buffers kept clean between calls, so that a
+    //gradient only costs the ops recorded after the prefix
+    mutable vector<double> mAdj;
+    mutable vector<bool> mTouched;
+    mutable vector<size_t> mReached;
+};
+
 #endif /* defined(__ddouble__bdouble__) */
@@ -0,0 +1,623 @@
+//          Copyright Juan Lucas Rey 2015 - 2016.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#ifndef __ddouble__chunkedVector__
+#define __ddouble__chunkedVector__
+
+#include <vector>
+#include <iterator>
+#include <cstddef>
+#include <istream>
+#include <ostream>
+#include <ios>
+#include <algorithm>
+#include <stdexcept>
+#include <system_error>
+#include <cerrno>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define ADHOC_TAPE_MMAP
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+//elements per chunk of the tape, as a power of 2
+#ifndef ADHOC_TAPE_CHUNK_BITS
+#define ADHOC_TAPE_CHUNK_BITS 16
+#endif
+
+//lightweight encodings of a full chunk. indices are stored as
+//zigzag varints of the difference with the previous element,
+//values through a small dictionary of recent bit patterns
+//with the other ones stored as they are.
+void pack_chunk(const size_t* in, const size_t& n, vector<unsigned char>& out);
+void unpack_chunk(const vector<unsigned char>& in, const size_t& n, size_t* out);
+void pack_chunk(const double* in, const size_t& n, vector<unsigned char>& out);
+void unpack_chunk(const vector<unsigned char>& in, const size_t& n, double* out);
+
+//append only storage made of fixed size chunks. growing
+//never moves what was already stored, and clear() keeps the
+//chunks so that the next recording reuses them. the chunks
+//can also live in a file mapped in memory, then the iterators
+//ask the system for the chunk they are heading to. in memory,
+//full chunks can be kept packed, they are unpacked one at a
+//time when read so at most two places of a packed vector
+//should be read at once.
+template <class T>
+class chunkedVector
+{
+public:
+    static const size_t chunk_bits = ADHOC_TAPE_CHUNK_BITS;
+    static const size_t chunk_size = size_t(1) << chunk_bits;
+    static const size_t chunk_mask = chunk_size - 1;
+    
+    //read only, keeps a pointer to the current element so
+    //that walking the tape doesn't look the chunk up each time
+    class const_iterator
+    {
+    public:
+        typedef random_access_iterator_tag iterator_category;
+        typedef T value_type;
+        typedef ptrdiff_t difference_type;
+        typedef const T* pointer;
+        typedef const T& reference;
+        
+        const_iterator() : mVec(0), mIndex(0), mChunk(-1), mPos(0) {}
+        const_iterator(const chunkedVector* vec, const size_t& index) : mVec(vec), mIndex(index), mChunk(-1) {seek(false);}
+        
+        reference operator*() const {return *mPos;}
+        pointer operator->() const {return mPos;}
+        reference operator[](const difference_type& n) const {return *(*this + n);}
+        
+        const_iterator& operator++()
+        {
+            mIndex++;
+            if((mIndex & chunk_mask) == 0)
+                seek();
+            else
+                mPos++;
+            return *this;
+        }
+        
+        const_iterator& operator--()
+        {
+            if((mIndex & chunk_mask) == 0)
+            {
+                mIndex--;
+                seek();
+            }
+            else
+            {
+                mIndex--;
+                mPos--;
+            }
+            return *this;
+        }
+        
+        const_iterator operator++(int) {const_iterator res(*this); ++(*this); return res;}
+        const_iterator operator--(int) {const_iterator res(*this); --(*this); return res;}
+        
+        const_iterator& operator+=(const difference_type& n)
+        {
+            mIndex += n;
+            seek();
+            return *this;
+        }
+        
+        const_iterator& operator-=(const difference_type& n) {return (*this) += -n;}
+        const_iterator operator+(const difference_type& n) const {const_iterator res(*this); return res += n;}
+        const_iterator operator-(const difference_type& n) const {const_iterator res(*this); return res -= n;}
+        difference_type operator-(const const_iterator& rhs) const {return difference_type(mIndex - rhs.mIndex);}
+        
+        bool operator==(const const_iterator& rhs) const {return mIndex == rhs.mIndex;}
+        bool operator!=(const const_iterator& rhs) const {return mIndex != rhs.mIndex;}
+        bool operator<(const const_iterator& rhs) const {return mIndex < rhs.mIndex;}
+        bool operator>(const const_iterator& rhs) const {return mIndex > rhs.mIndex;}
+        bool operator<=(const const_iterator& rhs) const {return mIndex <= rhs.mIndex;}
+        bool operator>=(const const_iterator& rhs) const {return mIndex >= rhs.mIndex;}
+    
+    private:
+        //the end of the last chunk has no element behind it
+        void seek(const bool& advise = true)
+        {
+            size_t chunk = mIndex >> chunk_bits;
+            if(mIndex < mVec->mSize)
+            {
+                mPos = mVec->chunk_data(chunk) + (mIndex & chunk_mask);
+                if(advise && chunk != mChunk)
+                    mVec->advise(chunk+1);
+                mChunk = chunk;
+            }
+            else
+                mPos = 0;
+        }
+        
+        const chunkedVector* mVec;
+        size_t mIndex;
+        size_t mChunk;
+        const T* mPos;
+    };
+    
+    //the reverse sweeps walk the tape with this one, it points
+    //at the element before mIndex like std::reverse_iterator but
+    //doesn't step back on each dereference
+    class const_reverse_iterator
+    {
+    public:
+        typedef random_access_iterator_tag iterator_category;
+        typedef T value_type;
+        typedef ptrdiff_t difference_type;
+        typedef const T* pointer;
+        typedef const T& reference;
+        
+        const_reverse_iterator() : mVec(0), mIndex(0), mChunk(-1), mPos(0) {}
+        const_reverse_iterator(const chunkedVector* vec, const size_t& index) : mVec(vec), mIndex(index), mChunk(-1) {seek(false);}
+        
+        reference operator*() const {return *mPos;}
+        pointer operator->() const {return mPos;}
+        reference operator[](const difference_type& n) const {return *(*this + n);}
+        
+        const_reverse_iterator& operator++()
+        {
+            mIndex--;
+            if((mIndex & chunk_mask) == 0)
+                seek();
+            else
+                mPos--;
+            return *this;
+        }
+        
+        const_reverse_iterator& operator--()
+        {
+            mIndex++;
+            if(((mIndex-1) & chunk_mask) == 0)
+                seek();
+            else
+                mPos++;
+            return *this;
+        }
+        
+        const_reverse_iterator operator++(int) {const_reverse_iterator res(*this); ++(*this); return res;}
+        const_reverse_iterator operator--(int) {const_reverse_iterator res(*this); --(*this); return res;}
+        
+        //short jumps stay in the chunk
+        const_reverse_iterator& operator+=(const difference_type& n)
+        {
+            size_t index = mIndex - n;
+            if(index > 0 && mIndex > 0 && ((index-1) >> chunk_bits) == ((mIndex-1) >> chunk_bits))
+            {
+                mIndex = index;
+                mPos -= n;
+            }
+            else
+            {
+                mIndex = index;
+                seek();
+            }
+            return *this;
+        }
+        
+        const_reverse_iterator& operator-=(const difference_type& n) {return (*this) += -n;}
+        const_reverse_iterator operator+(const difference_type& n) const {const_reverse_iterator res(*this); return res += n;}
+        const_reverse_iterator operator-(const difference_type& n) const {const_reverse_iterator res(*this); return res -= n;}
+        difference_type operator-(const const_reverse_iterator& rhs) const {return difference_type(rhs.mIndex - mIndex);}
+        
+        bool operator==(const const_reverse_iterator& rhs) const {return mIndex == rhs.mIndex;}
+        bool operator!=(const const_reverse_iterator& rhs) const {return mIndex != rhs.mIndex;}
+        bool operator<(const const_reverse_iterator& rhs) const {return mIndex > rhs.mIndex;}
+        bool operator>(const const_reverse_iterator& rhs) const {return mIndex < rhs.mIndex;}
+        bool operator<=(const const_reverse_iterator& rhs) const {return mIndex >= rhs.mIndex;}
+        bool operator>=(const const_reverse_iterator& rhs) const {return mIndex <= rhs.mIndex;}
+        
+        //position in the container of the element after this one
+        const size_t& base() const {return mIndex;}
+    
+    private:
+        //rend has no element in front of it
+        void seek(const bool& advise = true)
+        {
+            if(mIndex > 0)
+            {
+                size_t chunk = (mIndex-1) >> chunk_bits;
+                mPos = mVec->chunk_data(chunk) + ((mIndex-1) & chunk_mask);
+                if(advise && chunk != mChunk && chunk > 0)
+                    mVec->advise(chunk-1);
+                mChunk = chunk;
+            }
+            else
+                mPos = 0;
+        }
+        
+        const chunkedVector* mVec;
+        size_t mIndex;
+        size_t mChunk;
+        const T* mPos;
+    };
+    
+    chunkedVector() : mSize(0), mPos(0), mEnd(0), mFd(-1), mExtentEnd(0), mPack(false), mCacheLast(0), mBorrowed(0)
+    {
+        mCache[0] = mCache[1] = 0;
+        mCacheChunk[0] = mCacheChunk[1] = -1;
+    }
+    ~chunkedVector() {release();}
+    
+    void push_back(const T& value)
+    {
+        if(mPos == mEnd)
+            next_chunk();
+        *mPos++ = value;
+        mSize++;
+    }
+    
+    const T& back() const {return *(mPos-1);}
+    const T& operator[](const size_t& i) const {return chunk_data(i >> chunk_bits)[i & chunk_mask];}
+    
+    const size_t& size() const {return mSize;}
+    bool empty() const {return mSize == 0;}
+    //elements that fit in the chunks already allocated
+    size_t capacity() const {return mChunks.size() << chunk_bits;}
+    
+    const_iterator begin() const {return const_iterator(this,0);}
+    const_iterator end() const {return const_iterator(this,mSize);}
+    const_reverse_iterator rbegin() const {return const_reverse_iterator(this,mSize);}
+    const_reverse_iterator rend() const {return const_reverse_iterator(this,0);}
+    
+    //allocates chunks up front for n elements in total
+    void reserve(const size_t& n)
+    {
+        while(capacity() < n)
+            add_chunk();
+    }
+    
+    //the chunks are taken from the file at path from now on, it
+    //is created or truncated. the vector has to be released.
+    void map_file(const char* path)
+    {
+#ifdef ADHOC_TAPE_MMAP
+        if(!mChunks.empty() || mPack)
+            throw std::logic_error("chunkedVector::map_file: the vector has to be released and unpacked");
+        
+        mFd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if(mFd == -1)
+            throw std::system_error(errno, std::generic_category(), string("chunkedVector::map_file: open ") + path);
+        mExtentEnd = 0;
+#else
+        throw std::runtime_error("chunkedVector::map_file: mapped tapes are not supported on this platform");
+#endif
+    }
+    
+    bool mapped() const {return mFd != -1;}
+    
+    //writes the elements as they are
+    void write(ostream& out) const
+    {
+        for(size_t done = 0; done < mSize; done += chunk_size)
+            out.write((const char*)chunk_data(done >> chunk_bits), min(chunk_size, mSize - done)*sizeof(T));
+    }
+    
+    //appends n elements read from in
+    void read(istream& in, const size_t& n)
+    {
+        for(size_t done = 0; done < n;)
+        {
+            if(mPos == mEnd)
+                next_chunk();
+            
+            size_t count = min(size_t(mEnd - mPos), n - done);
+            if(!in.read((char*)mPos, count*sizeof(T)))
+                throw std::ios_base::failure("chunkedVector::read: unexpected end of stream");
+            
+            mPos += count;
+            mSize += count;
+            done += count;
+        }
+    }
+    
+    //the n elements at data become the content of the vector. the
+    //full chunks are read in place so data has to stay valid until
+    //the next clear or release, the rest is copied.
+    void adopt(const T* data, const size_t& n)
+    {
+        if(mSize != 0 || mFd != -1)
+            throw std::logic_error("chunkedVector::adopt: the vector has to be empty and in memory");
+        
+        clear();
+        for(size_t i = 0; i < mChunks.size(); i++)
+            if(mChunks[i] != 0)
+                mSpare.push_back(mChunks[i]);
+        mChunks.clear();
+        
+        mBorrowed = n >> chunk_bits;
+        for(size_t i = 0; i < mBorrowed; i++)
+            mChunks.push_back(const_cast<T*>(data + (i << chunk_bits)));
+        mSize = mBorrowed << chunk_bits;
+        
+        for(size_t i = mSize; i < n; i++)
+            push_back(data[i]);
+    }
+    
+    //drops the elements from n on, the chunk of element n is
+    //made writable again
+    void truncate(const size_t& n)
+    {
+        if(n > mSize)
+            throw std::invalid_argument("chunkedVector::truncate: past the end");
+        
+        size_t chunk = n >> chunk_bits;
+        for(size_t i = 0; i < 2; i++)
+            if(mCacheChunk[i] != size_t(-1) && mCacheChunk[i] >= chunk)
+                mCacheChunk[i] = -1;
+        
+        //adopted chunks can't be written to
+        for(size_t i = chunk; i < mBorrowed; i++)
+        {
+            if(i == chunk && (n & chunk_mask) != 0)
+            {
+                T* buffer = new_buffer();
+                copy(mChunks[i], mChunks[i] + chunk_size, buffer);
+                mChunks[i] = buffer;
+            }
+            else
+                mChunks[i] = 0;
+        }
+        mBorrowed = min(mBorrowed, chunk);
+        
+        mSize = n;
+        if((n & chunk_mask) == 0)
+        {
+            mPos = mEnd = 0;
+            return;
+        }
+        
+        if(mChunks[chunk] == 0)
+        {
+            mChunks[chunk] = new_buffer();
+            unpack_chunk(mPacked[chunk], chunk_size, mChunks[chunk]);
+        }
+        
+        mPos = mChunks[chunk] + (n & chunk_mask);
+        mEnd = mChunks[chunk] + chunk_size;
+    }
+    
+    //keeps the full chunks packed from now on, the ones already
+    //recorded are packed right away. mapped vectors can't be packed.
+    void pack(const bool& on)
+    {
+        if(on && mFd != -1)
+            throw std::logic_error("chunkedVector::pack: a mapped vector can't be packed");
+        
+        //the chunk of the last element stays as it is until
+        //the next one is started
+        mPack = on;
+        size_t full = mSize > 0 ? (mSize-1) >> chunk_bits : 0;
+        for(size_t chunk = 0; mPack && chunk < full; chunk++)
+            if(mChunks[chunk] != 0)
+                pack_full_chunk(chunk);
+    }
+    
+    bool packed() const {return mPack;}
+    
+    //memory taken by the elements recorded
+    size_t bytes() const
+    {
+        size_t res = 0;
+        size_t used = (mSize + chunk_mask) >> chunk_bits;
+        for(size_t chunk = 0; chunk < used; chunk++)
+            res += mChunks[chunk] != 0 ? min(chunk_size, mSize - (chunk << chunk_bits))*sizeof(T) : mPacked[chunk].size();
+        return res;
+    }
+    
+    //the chunks are kept for the next recording, adopted
+    //ones are dropped
+    void clear()
+    {
+        for(size_t i = 0; i < mBorrowed; i++)
+            mChunks[i] = 0;
+        mBorrowed = 0;
+        
+        mSize = 0;
+        mPos = mEnd = 0;
+        mCacheChunk[0] = mCacheChunk[1] = -1;
+    }
+    
+    //gives the chunks back, a mapped file is closed and
+    //left on disk
+    void release()
+    {
+        clear();
+
+#ifdef ADHOC_TAPE_MMAP
+        if(mFd != -1)
+        {
+            for(size_t i = 0; i < mExtents.size(); i++)
+                munmap(mExtents[i].first, mExtents[i].second);
+            mExtents.clear();
+            close(mFd);
+            mFd = -1;
+            mChunks.clear();
+        }
+#endif
+        
+        for(size_t i = 0; i < mChunks.size(); i++)
+            delete[] mChunks[i];
+        mChunks.clear();
+        
+        for(size_t i = 0; i < mSpare.size(); i++)
+            delete[] mSpare[i];
+        mSpare.clear();
+        
+        delete[] mCache[0];
+        delete[] mCache[1];
+        mCache[0] = mCache[1] = 0;
+        
+        mPacked.clear();
+        clear();
+    }
+
+private:
+    chunkedVector(const chunkedVector&);
+    chunkedVector& operator=(const chunkedVector&);
+    
+    void next_chunk()
+    {
+        size_t chunk = mSize >> chunk_bits;
+        
+        //the chunk we leave is full, it may already be packed
+        //if the vector was truncated
+        if(mPack && chunk > 0 && mChunks[chunk-1] != 0)
+            pack_full_chunk(chunk-1);
+        
+        if(chunk == mChunks.size())
+            add_chunk();
+        
+        //a packed chunk of a previous recording
+        if(mChunks[chunk] == 0)
+            mChunks[chunk] = new_buffer();
+        
+        mPos = mChunks[chunk];
+        mEnd = mPos + chunk_size;
+    }
+    
+    //its buffer is kept for the next chunks
+    void pack_full_chunk(const size_t& chunk)
+    {
+        if(mPacked.size() < mChunks.size())
+            mPacked.resize(mChunks.size());
+        
+        pack_chunk(mChunks[chunk], chunk_size, mPacked[chunk]);
+        if(chunk >= mBorrowed)
+            mSpare.push_back(mChunks[chunk]);
+        mChunks[chunk] = 0;
+        
+        for(size_t i = 0; i < 2; i++)
+            if(mCacheChunk[i] == chunk)
+                mCacheChunk[i] = -1;
+    }
+    
+    T* new_buffer()
+    {
+        if(mSpare.empty())
+            return new T[chunk_size];
+        
+        T* res = mSpare.back();
+        mSpare.pop_back();
+        return res;
+    }
+    
+    const T* chunk_data(const size_t& chunk) const
+    {
+        return mChunks[chunk] != 0 ? mChunks[chunk] : unpack(chunk);
+    }
+    
+    //two chunks are kept unpacked, the one used least
+    //recently is replaced
+    const T* unpack(const size_t& chunk) const
+    {
+        size_t slot;
+        if(mCacheChunk[0] == chunk)
+            slot = 0;
+        else if(mCacheChunk[1] == chunk)
+            slot = 1;
+        else
+        {
+            slot = 1 - mCacheLast;
+            if(mCache[slot] == 0)
+                mCache[slot] = new T[chunk_size];
+            
+            unpack_chunk(mPacked[chunk], chunk_size, mCache[slot]);
+            mCacheChunk[slot] = chunk;
+        }
+        
+        mCacheLast = slot;
+        return mCache[slot];
+    }
+    
+    void add_chunk()
+    {
+#ifdef ADHOC_TAPE_MMAP
+        if(mFd != -1)
+        {
+            //chunks start on a page. they are mapped by extents that
+            //double up to max_extent_chunks() so that large files
+            //stay far below the limit on the number of mappings
+            size_t chunk = mChunks.size();
+            if(chunk == mExtentEnd)
+            {
+                size_t count = min(max(chunk, size_t(16)), max_extent_chunks());
+                void* extent = mmap(0, count*mapped_bytes(), PROT_READ | PROT_WRITE, MAP_SHARED, mFd, off_t(chunk*mapped_bytes()));
+                if(extent == MAP_FAILED)
+                    throw std::system_error(errno, std::generic_category(), "chunkedVector: mmap");
+                
+                mExtents.push_back(make_pair(extent, count*mapped_bytes()));
+                mExtentEnd = chunk + count;
+            }
+            
+            //the file only grows by the chunks in use
+            if(ftruncate(mFd, off_t((chunk+1)*mapped_bytes())) != 0)
+                throw std::system_error(errno, std::generic_category(), "chunkedVector: ftruncate");
+            
+            size_t first = mExtentEnd - mExtents.back().second/mapped_bytes();
+            mChunks.push_back((T*)((char*)mExtents.back().first + (chunk - first)*mapped_bytes()));
+            return;
+        }
+#endif
+        mChunks.push_back(new_buffer());
+    }
+
+#ifdef ADHOC_TAPE_MMAP
+    //chunks in the largest extent, 8GB of address space
+    static size_t max_extent_chunks()
+    {
+        size_t bytes = size_t(1) << (sizeof(size_t) > 4 ? 33 : 28);
+        return max(bytes/mapped_bytes(), size_t(1));
+    }
+    
+    static size_t mapped_bytes()
+    {
+        size_t page = sysconf(_SC_PAGESIZE);
+        return (chunk_size*sizeof(T) + page - 1)/page*page;
+    }
+#endif
+    
+    //the next chunk an iterator is going to read
+    void advise(const size_t& chunk) const
+    {
+#ifdef ADHOC_TAPE_MMAP
+        if(mFd != -1 && chunk < mChunks.size())
+            madvise(mChunks[chunk], mapped_bytes(), MADV_WILLNEED);
+#endif
+    }
+    
+    vector<T*> mChunks;
+    size_t mSize;
+    T* mPos;
+    T* mEnd;
+    //file the chunks are mapped from, -1 in memory
+    int mFd;
+    //mappings of the file and the chunk after the last one
+    vector<pair<void*,size_t> > mExtents;
+    size_t mExtentEnd;
+    
+    //full chunks are packed when mPack, their entry in
+    //mChunks is then 0 and their buffer goes to mSpare
+    bool mPack;
+    vector<vector<unsigned char> > mPacked;
+    vector<T*> mSpare;
+    mutable T* mCache[2];
+    mutable size_t mCacheChunk[2];
+    mutable size_t mCacheLast;
+    
+    //the first mBorrowed chunks were adopted and aren't ours
+    size_t mBorrowed;
+};
+
+template <class T> const size_t chunkedVector<T>::chunk_bits;
+template <class T> const size_t chunkedVector<T>::chunk_size;
+template <class T> const size_t chunkedVector<T>::chunk_mask;
+
+#endif /* defined(__ddouble__chunkedVector__) */
@@ -8,6 +8,10 @@
 
 #include <vector>
 #include <algorithm>
+#include <limits>
+#include <array>
+#include <stdexcept>
+#include <cmath>
 using namespace std;
 
 class partitionGenerator
@@ -20,7 +24,6 @@ public:
 private:
     size_t n;
     bool first;
-    vector<size_t> factorials;
 };
 
 class partitionGeneratorDistinct
@@ -33,16 +36,26 @@ private:
     bool first;
 };
 
+//multisets are enumerated in the order of multisetcount.
+//the range version only goes through the ranks in
+//[beginrank,endrank) so that the enumeration can be split
 class multisetGenerator
 {
 public:
     multisetGenerator(const size_t& casesin,const size_t& unitsin);
+    multisetGenerator(const size_t& casesin,const size_t& unitsin,const size_t& beginrankin,const size_t& endrankin);
     bool next(vector<size_t>& b);
     bool prev(vector<size_t>& b);
+    
+    //rank of the last multiset returned
+    const size_t& rank() const {return currentrank;}
 private:
     size_t cases;
     size_t units;
     bool first;
+    size_t beginrank;
+    size_t endrank;
+    size_t currentrank;
 };
 
 class combinationGenerator
@@ -58,69 +71,364 @@ private:
     bool first;
 };
 
-inline size_t combins(size_t d1,size_t d2,const bool d2totalElements = false)
+//fixed capacity versions of the generators above, N bounds
+//the size of the multisets. they work on caller provided
+//arrays and never touch the heap.
+#ifndef ADHOC_FIXED_MAX_ORDER
+#define ADHOC_FIXED_MAX_ORDER 64
+#endif
+
+//multiplicity of a partition given by its size parts in
+//decreasing order
+size_t partitionmultiplicity(const size_t* b,const size_t& size,const size_t& n);
+
+template<size_t N>
+class partitionGeneratorFixed
 {
-    if(d2totalElements)
+public:
+    partitionGeneratorFixed(const size_t& nin)
     {
-        if(d2<d1)
-            return 0;
+        if(nin > N || nin == 0)
+            throw std::invalid_argument("partitionGeneratorFixed: n must be in [1, N]");
+        
+        n = nin;
+        first = true;
     }
-    else
+    
+    bool next(array<size_t,N>& b,size_t& size)
     {
-        if (d2 < d1)
-            swap(d1, d2);
+        if(first)
+        {
+            b[0] = n;
+            size = 1;
+            
+            first = false;
+            return true;
+        }
+        
+        if(b[0] == 1)
+            return false;
+        
+        size_t rem_val = 0;
+        while(size > 0 && b[size-1] == 1)
+        {
+            rem_val++;
+            size--;
+        }
+        
+        b[size-1]--;
+        rem_val++;
+        
+        while(rem_val > b[size-1])
+        {
+            b[size] = b[size-1];
+            rem_val -= b[size];
+            size++;
+        }
+        
+        b[size] = rem_val;
+        size++;
+        
+        return true;
     }
     
-    if (d1 == 0)
-        return 1;
-    
-    
+    size_t multiplicity(const array<size_t,N>& b,const size_t& size) const
+    {
+        return partitionmultiplicity(b.data(),size,n);
+    }
+
+private:
     size_t n;
+    bool first;
+};
+
+template<size_t N>
+class partitionGeneratorDistinctFixed
+{
+public:
+    partitionGeneratorDistinctFixed(const size_t& nin)
+    {
+        if(nin > N)
+            throw std::invalid_argument("partitionGeneratorDistinctFixed: n exceeds N");
+        
+        n = nin;
+        first = true;
+    }
     
-    if(d2totalElements)
-        n = d2;
-    else
-        n = d1 + d2;
+    //only the first n entries of b are used
+    bool next(array<size_t,N>& b)
+    {
+        if(first)
+        {
+            std::fill(b.begin(), b.begin()+n, 1);
             
-    size_t r = n;
-    n--;
+            first = false;
+            return true;
+        }
+        
+        size_t i,j;
+        for(i = (n-1); i != numeric_limits<size_t>::max(); i--)
+        {
+            j = i-1;
+            while(j != numeric_limits<size_t>::max() && b[j] < b[i])
+                j--;
+            
+            if(j != numeric_limits<size_t>::max())
+                break;
+        }
+        
+        if(i == numeric_limits<size_t>::max())
+            return false;
+        
+        b[i]++;
+        for(size_t j = i+1; j < n ; j++)
+            b[j] = 1;
+        
+        return true;
+    }
+
+private:
+    size_t n;
+    bool first;
+};
+
+template<size_t N>
+class combinationGeneratorFixed
+{
+public:
+    combinationGeneratorFixed(const size_t& casesin, const size_t& basein)
+    {
+        if(casesin > N)
+            throw std::invalid_argument("combinationGeneratorFixed: cases exceeds N");
+        
+        cases = casesin;
+        base = basein-1;
+        first = true;
+    }
     
-    for(size_t d = 2; d <= d1; ++d,--n)
+    //only the first cases entries of b are used
+    bool next(array<size_t,N>& b)
     {
-        r *= n;
-        r /= d;
+        if(first)
+        {
+            std::fill(b.begin(), b.begin()+cases, 0);
+            
+            first = false;
+            return true;
+        }
+        
+        size_t j = 0;
+        while(j < cases)
+        {
+            if(b[j] == base)
+                b[j] = 0;
+            else
+            {
+                b[j]++;
+                break;
+            }
+            j++;
+        }
+        
+        return j != cases;
     }
+
+private:
+    size_t cases;
+    size_t base;
+    bool first;
+};
+
+//the combinatorics below sit in the innermost loops of
+//the higher order sweep so they are tabulated once at
+//startup. binomials C(k+n,k) are kept for k < ADHOC_COMBINS_MAX_K
+//and n < ADHOC_COMBINS_MAX_N, partitions up to ADHOC_PARTITIONS_MAX.
+//values that don't fit in a size_t saturate at its max.
+#ifndef ADHOC_COMBINS_MAX_K
+#define ADHOC_COMBINS_MAX_K 16
+#endif
+
+#ifndef ADHOC_COMBINS_MAX_N
+#define ADHOC_COMBINS_MAX_N 256
+#endif
+
+#ifndef ADHOC_PARTITIONS_MAX
+#define ADHOC_PARTITIONS_MAX 16
+#endif
+
+//20! is the last factorial that fits in 64 bits
+const size_t factorials_max = 20;
+
+struct partitionEntry
+{
+    vector<size_t> parts;
+    size_t multiplicity;
+};
+
+class combinatoricsTables
+{
+public:
+    combinatoricsTables();
     
-    return r;
+    size_t binomials[ADHOC_COMBINS_MAX_K][ADHOC_COMBINS_MAX_N];
+    size_t factorials[factorials_max+1];
 };
 
-inline size_t combins2(size_t d1,size_t d2)
+//built on first use, so that static initializers of other
+//translation units can use them
+inline const combinatoricsTables& combinatorics_tables()
 {
-    if (d2 < d1)
-        swap(d1, d2);
+    static const combinatoricsTables tables;
+    return tables;
+}
+
+inline size_t mult_checked(const size_t& a,const size_t& b)
+{
+    if(a != 0 && b > numeric_limits<size_t>::max()/a)
+        return numeric_limits<size_t>::max();
     
-    if (d1 == 0)
-        return 1;
+    return a*b;
+}
+
+//C(k+n,k) without the table
+inline size_t combins_loop(const size_t& k,const size_t& n)
+{
+#ifdef __SIZEOF_INT128__
+    //r is C(n+d-1,d-1) so r*(n+d) is a multiple of d,
+    //and it fits in 128 bits as long as r fits in 64
+    unsigned __int128 r = 1;
+    for(size_t d = 1; d <= k; ++d)
+    {
+        r = r*(n+d)/d;
+        if(r >= numeric_limits<size_t>::max())
+            return numeric_limits<size_t>::max();
+    }
     
-    size_t n = d2;
+    return (size_t)r;
+#else
+    size_t r = 1;
+    for(size_t d = 1; d <= k; ++d)
+    {
+        //r is C(n+d-1,d-1) so r*(n+d) is a multiple of d,
+        //dividing first only overflows if the result does
+        size_t g = d;
+        size_t rem = r;
+        while(rem != 0)
+        {
+            size_t temp = g % rem;
+            g = rem;
+            rem = temp;
+        }
+        
+        r = mult_checked(r/g,(n+d)/(d/g));
+        if(r == numeric_limits<size_t>::max())
+            return r;
+    }
+    
+    return r;
+#endif
+}
+
+//C(k+n,k)
+inline size_t combins_kn(size_t k,size_t n)
+{
+    if(n < k)
+        swap(k, n);
     
-    size_t r = n;
-    n--;
+    if(k < ADHOC_COMBINS_MAX_K && n < ADHOC_COMBINS_MAX_N)
+        return combinatorics_tables().binomials[k][n];
     
-    for(size_t d = 2; d <= d1; ++d,--n)
+    return combins_loop(k,n);
+}
+
+inline size_t combins(size_t d1,size_t d2,const bool d2totalElements = false)
+{
+    if(d2totalElements)
     {
-        r *= n;
-        r /= d;
+        if(d2<d1)
+            return 0;
+        
+        return combins_kn(d1,d2-d1);
     }
     
-    return r;
+    return combins_kn(d1,d2);
 };
 
+inline size_t combins2(size_t d1,size_t d2)
+{
+    if (d2 < d1)
+        swap(d1, d2);
+    
+    return combins_kn(d1,d2-d1);
+};
+
+//false if C(k+n,k) doesn't fit in a size_t
+inline bool combins_checked(const size_t& k,const size_t& n,size_t& res)
+{
+    if(n > numeric_limits<size_t>::max() - k)
+        return false;
+    
+    res = combins_kn(k,n);
+    return res != numeric_limits<size_t>::max();
+}
+
+//log(C(k+n,k)), for estimates of sizes that overflow
+inline double lcombins(const size_t& k,const size_t& n)
+{
+    return std::lgamma((double)k+n+1) - std::lgamma((double)k+1) - std::lgamma((double)n+1);
+}
+
+inline size_t factorial(const size_t& n)
+{
+    if(n <= factorials_max)
+        return combinatorics_tables().factorials[n];
+    
+    return numeric_limits<size_t>::max();
+}
+
+//partitions of n in the order of partitionGenerator
+//with their multiplicities. beyond ADHOC_PARTITIONS_MAX
+//they are generated into buffer, which is returned.
+const vector<partitionEntry>& partitions(const size_t& n,vector<partitionEntry>& buffer);
+
 inline size_t multisetcoeff(const size_t& n,const size_t& k)
 {
     return combins(n-1,k);
 }
 
+//ranks of the multisets obtained from a base multiset by
+//moving units from b[0] to a few fixed positions. once the
+//base is set each rank costs O(number of positions) instead
+//of the O(cases) of multisetcount.
+class multisetRanker
+{
+public:
+    multisetRanker(const size_t& casesin,const size_t& unitsin,const vector<size_t>& positionsin);
+    
+    //b has to be 0 on the positions
+    void set(const vector<size_t>& b);
+    
+    //moved[i] units go to positions[i]
+    size_t rank(const size_t* moved) const;
+
+private:
+    size_t cases;
+    size_t units;
+    
+    //sorted positions and their index in the constructor argument
+    vector<size_t> positions;
+    vector<size_t> positions_order;
+    
+    //ranks are base plus, for each segment between two
+    //positions, a value that depends on the units moved
+    //at or after the segment
+    size_t base;
+    vector<size_t> offsets;
+};
+
+//inverse of multisetcount
+void multisetunrank(size_t rank,const size_t& cases,const size_t& units,vector<size_t>& b);
+
 inline size_t multisetcount(const vector<size_t>& b,const size_t& k)
 {
     size_t ballsLeft = k;
@@ -128,8 +436,10 @@ inline size_t multisetcount(const vector<size_t>& b,const size_t& k)
     size_t m = b.size();
     for(size_t i = 0; ballsLeft != 0 && i < m; i++)
     {
-        for(size_t j = b[i]; j < ballsLeft; j++)
-            r += combins(m-i-2,ballsLeft-j-1);
+        //sum of combins(m-i-2,ballsLeft-j-1) for j from
+        //b[i] to ballsLeft-1, in closed form
+        if(b[i] < ballsLeft)
+            r += combins(m-i-1,ballsLeft-b[i]-1);
         
         ballsLeft -= b[i];
     }
@@ -0,0 +1,56 @@
+//          Copyright Juan Lucas Rey 2015 - 2016.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#ifndef __ddouble__taylorPolynomial__
+#define __ddouble__taylorPolynomial__
+
+#include <vector>
+#include "bdouble.h"
+using namespace std;
+
+//truncated multivariate taylor polynomial around a point.
+//coefficients are stored divided by the factorials
+//(f_a / a!) and in the same multiset order as bdouble
+//coefficients: idxes[0] is the order left and idxes[i]
+//the power of variable i.
+class taylorPolynomial
+{
+public:
+    taylorPolynomial(const size_t& nvarin, const size_t& orderin, const kdouble& value = 0);
+    
+    //x_i around value
+    static taylorPolynomial variable(const size_t& nvarin, const size_t& orderin, const size_t& var, const kdouble& value);
+    
+    taylorPolynomial operator+(const taylorPolynomial& rhs) const;
+    taylorPolynomial operator-(const taylorPolynomial& rhs) const;
+    taylorPolynomial operator*(const taylorPolynomial& rhs) const;
+    taylorPolynomial operator+(const kdouble& rhs) const;
+    taylorPolynomial operator*(const kdouble& rhs) const;
+    
+    //f(this) where taylorexp holds the derivatives of f
+    //at the value of this polynomial
+    taylorPolynomial compose(const vector<kdouble>& taylorexp) const;
+    
+    //replaces variable i by variable var_map[i]
+    taylorPolynomial substitute(const vector<size_t>& var_map, const size_t& nvarout) const;
+    
+    const kdouble& value() const {return mCoeff[0];}
+    kdouble& value() {return mCoeff[0];}
+    
+    //partial derivative, powers are given without idxes[0]
+    kdouble der(const vector<size_t>& powers) const;
+    
+    const size_t& nvar() const {return mNvar;}
+    const size_t& order() const {return mOrder;}
+    const vector<kdouble>& coeffs() const {return mCoeff;}
+    vector<kdouble>& coeffs() {return mCoeff;}
+
+private:
+    size_t mNvar;
+    size_t mOrder;
+    vector<kdouble> mCoeff;
+};
+
+#endif /* defined(__ddouble__taylorPolynomial__) */
@@ -12,16 +12,29 @@
 #include <cmath>
 #include <algorithm>
 #include <stack>
+#include <stdexcept>
+#include <set>
+#include <unordered_map>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <stdint.h>
 #include <boost/math/special_functions/polygamma.hpp>
 #include "partitionGenerator.h"
+#include "taylorPolynomial.h"
 
 size_t bdouble::mDefaultOrder = 1;
+size_t bdouble::mLastMaxNvar = 0;
 
 //tape
-vector<size_t> bdouble::op_trace(0,0);
-vector<size_t> bdouble::index_trace(0,0);
-vector<double> bdouble::val_trace;
+chunkedVector<size_t> bdouble::op_trace;
+chunkedVector<size_t> bdouble::index_trace;
+chunkedVector<double> bdouble::val_trace;
 size_t bdouble::indexcount = 0;
+size_t bdouble::mFoldFloor = 0;
+size_t bdouble::mTapeGeneration = 0;
+void* bdouble::mTapeFile = 0;
+size_t bdouble::mTapeFileBytes = 0;
 
 bdouble::bdouble(const double& rhs)
 {
@@ -31,6 +44,12 @@ bdouble::bdouble(const double& rhs)
     mValue = rhs;
 }
 
+bdouble::bdouble(const double& value, const size_t& id)
+{
+    mThisId = id;
+    mValue = value;
+}
+
 bdouble::bdouble(const bdouble& rhs)
 {
     mValue = rhs.mValue;
@@ -81,7 +100,7 @@ bdouble bdouble::operator-(const bdouble& rhs) const
     //then this is effectively a function
     //of one parameter
     if(lhs.id() == rhs.id())
-        return rhs*0;
+        return bdouble(lhs.mValue - rhs.mValue);
     else
     {
         bdouble res(lhs.mValue - rhs.mValue);
@@ -175,15 +194,37 @@ bdouble name (const bdouble& in)                        \
     return res;                                         \
 }
 
-function_define_no_store_value(exp);
 function_define_no_store_value(exp2);
 function_define_no_store_value(tan);
 function_define_no_store_value(tanh);
 
 #undef function_define_no_store_value
 
+bdouble exp(const bdouble& in)
+{
+    //exp(log(x)) is x, for x > 0 only
+    size_t arg;
+    if(std::isfinite(in.mValue) && bdouble::last_op(logv,in.mThisId,arg))
+        return bdouble(bdouble::val_trace[bdouble::val_trace.size()-2],arg);
+    
+    bdouble::val_trace.push_back(exp(in.mValue));
+    
+    bdouble res(bdouble::val_trace.back());
+    
+    bdouble::op_trace.push_back(expv);
+    bdouble::index_trace.push_back(in.mThisId);
+    bdouble::index_trace.push_back(res.mThisId);
+    
+    return res;
+}
+
 bdouble inv(const bdouble& in)
 {
+    //inv(inv(x)) is x, for x finite and non zero only
+    size_t arg;
+    if(std::isfinite(in.mValue) && in.mValue != 0 && bdouble::last_op(invv,in.mThisId,arg))
+        return bdouble(1.0/in.mValue,arg);
+    
     bdouble::val_trace.push_back(1.0/in.mValue);
     
     bdouble res(bdouble::val_trace.back());
@@ -197,6 +238,9 @@ bdouble inv(const bdouble& in)
 
 bdouble pow(const bdouble& in, const int& deg)
 {
+    if(deg == 1)
+        return in;
+    
     bdouble::val_trace.push_back(in.mValue);
     bdouble::val_trace.push_back(deg);
     bdouble::val_trace.push_back(pow(in.mValue,deg));
@@ -213,6 +257,9 @@ bdouble pow(const bdouble& in, const int& deg)
 
 bdouble pow(const bdouble& in, const double& deg)
 {
+    if(deg == 1)
+        return in;
+    
     bdouble::val_trace.push_back(in.mValue);
     bdouble::val_trace.push_back(deg);
     bdouble::val_trace.push_back(pow(in.mValue,deg));
@@ -228,12 +275,27 @@ bdouble pow(const bdouble& in, const double& deg)
 
 bdouble pow(const double& val, const bdouble& in)
 {
-    return exp(log(val)*in);
+    bdouble::val_trace.push_back(in.mValue);
+    bdouble::val_trace.push_back(val);
+    bdouble::val_trace.push_back(pow(val,in.mValue));
+    
+    bdouble res(bdouble::val_trace.back());
+    
+    bdouble::op_trace.push_back(powbasev);
+    bdouble::index_trace.push_back(in.mThisId);
+    bdouble::index_trace.push_back(res.mThisId);
+    
+    return res;
 }
 
 bdouble pow(const bdouble& lhs, const bdouble& rhs)
 {
-    return exp(log(lhs)*rhs);
+    vector<bdouble> args;
+    args.reserve(2);
+    args.push_back(lhs);
+    args.push_back(rhs);
+    
+    return bdouble::record_nary(powbv,args,pow(lhs.mValue,rhs.mValue));
 }
 
 bdouble sqrt(const bdouble& in)
@@ -280,12 +342,243 @@ bdouble N(const bdouble& in)
     return res;
 }
 
+bdouble npdf(const bdouble& in)
+{
+    bdouble::val_trace.push_back(in.mValue);
+    bdouble::val_trace.push_back(0.5*M_2_SQRTPI*M_SQRT1_2*std::exp(-in.mValue*in.mValue*0.5));
+    
+    bdouble res(bdouble::val_trace.back());
+    
+    bdouble::op_trace.push_back(npdfv);
+    bdouble::index_trace.push_back(in.mThisId);
+    bdouble::index_trace.push_back(res.mThisId);
+    
+    return res;
+}
+
+//values and ids of the arguments are stored in order,
+//followed by the result
+bdouble bdouble::record_nary(const size_t& op, const vector<bdouble>& args, const double& value)
+{
+    for(size_t i = 0; i < args.size(); i++)
+        bdouble::val_trace.push_back(args[i].mValue);
+    bdouble::val_trace.push_back(value);
+    
+    bdouble res(bdouble::val_trace.back());
+    
+    bdouble::op_trace.push_back(op);
+    for(size_t i = 0; i < args.size(); i++)
+        bdouble::index_trace.push_back(args[i].mThisId);
+    bdouble::index_trace.push_back(res.mThisId);
+    
+    return res;
+}
+
+bdouble blackscholes(const bdouble& F, const bdouble& K, const bdouble& sigma, const bdouble& T)
+{
+    double stdev = sigma.mValue*std::sqrt(T.mValue);
+    double d1 = std::log(F.mValue/K.mValue)/stdev + 0.5*stdev;
+    double d2 = d1 - stdev;
+    double value = F.mValue*0.5*std::erfc(-d1*M_SQRT1_2) - K.mValue*0.5*std::erfc(-d2*M_SQRT1_2);
+    
+    //copies don't create new ids
+    vector<bdouble> args;
+    args.reserve(4);
+    args.push_back(F);
+    args.push_back(K);
+    args.push_back(sigma);
+    args.push_back(T);
+    
+    return bdouble::record_nary(blackscholesv,args,value);
+}
+
+bdouble lognpdf(const bdouble& x, const bdouble& mu, const bdouble& sigma)
+{
+    double z = (std::log(x.mValue) - mu.mValue)/sigma.mValue;
+    double value = 0.5*M_2_SQRTPI*M_SQRT1_2*std::exp(-z*z*0.5)/(x.mValue*sigma.mValue);
+    
+    vector<bdouble> args;
+    args.reserve(3);
+    args.push_back(x);
+    args.push_back(mu);
+    args.push_back(sigma);
+    
+    return bdouble::record_nary(lognpdfv,args,value);
+}
+
+bdouble atan2(const bdouble& arg1, const bdouble& arg2)
+{
+    vector<bdouble> args;
+    args.reserve(2);
+    args.push_back(arg1);
+    args.push_back(arg2);
+    
+    return bdouble::record_nary(atan2v,args,std::atan2(arg1.mValue,arg2.mValue));
+}
+
+bdouble hypot(const bdouble& arg1, const bdouble& arg2)
+{
+    vector<bdouble> args;
+    args.reserve(2);
+    args.push_back(arg1);
+    args.push_back(arg2);
+    
+    return bdouble::record_nary(hypotv,args,std::hypot(arg1.mValue,arg2.mValue));
+}
+
+bdouble fma(const bdouble& arg1, const bdouble& arg2, const bdouble& arg3)
+{
+    vector<bdouble> args;
+    args.reserve(3);
+    args.push_back(arg1);
+    args.push_back(arg2);
+    args.push_back(arg3);
+    
+    return bdouble::record_nary(fmav,args,std::fma(arg1.mValue,arg2.mValue,arg3.mValue));
+}
+
+bdouble fabs(const bdouble& in)
+{
+    bdouble::val_trace.push_back(in.mValue);
+    bdouble::val_trace.push_back(std::fabs(in.mValue));
+    
+    bdouble res(bdouble::val_trace.back());
+    
+    bdouble::op_trace.push_back(fabsv);
+    bdouble::index_trace.push_back(in.mThisId);
+    bdouble::index_trace.push_back(res.mThisId);
+    
+    return res;
+}
+
+bdouble abs(const bdouble& in)
+{
+    return fabs(in);
+}
+
+bdouble fmax(const bdouble& arg1, const bdouble& arg2)
+{
+    vector<bdouble> args;
+    args.reserve(2);
+    args.push_back(arg1);
+    args.push_back(arg2);
+    
+    return bdouble::record_nary(fmaxv,args,(arg1.mValue >= arg2.mValue) ? arg1.mValue : arg2.mValue);
+}
+
+bdouble fmin(const bdouble& arg1, const bdouble& arg2)
+{
+    vector<bdouble> args;
+    args.reserve(2);
+    args.push_back(arg1);
+    args.push_back(arg2);
+    
+    return bdouble::record_nary(fminv,args,(arg1.mValue <= arg2.mValue) ? arg1.mValue : arg2.mValue);
+}
+
+bdouble fmax(const bdouble& arg1, const double& arg2)
+{
+    bdouble::val_trace.push_back(arg1.mValue);
+    bdouble::val_trace.push_back(arg2);
+    bdouble::val_trace.push_back((arg1.mValue >= arg2) ? arg1.mValue : arg2);
+    
+    bdouble res(bdouble::val_trace.back());
+    
+    bdouble::op_trace.push_back(fmaxconstv);
+    bdouble::index_trace.push_back(arg1.mThisId);
+    bdouble::index_trace.push_back(res.mThisId);
+    
+    return res;
+}
+
+bdouble fmin(const bdouble& arg1, const double& arg2)
+{
+    bdouble::val_trace.push_back(arg1.mValue);
+    bdouble::val_trace.push_back(arg2);
+    bdouble::val_trace.push_back((arg1.mValue <= arg2) ? arg1.mValue : arg2);
+    
+    bdouble res(bdouble::val_trace.back());
+    
+    bdouble::op_trace.push_back(fminconstv);
+    bdouble::index_trace.push_back(arg1.mThisId);
+    bdouble::index_trace.push_back(res.mThisId);
+    
+    return res;
+}
+
+bdouble fmax(const double& arg1, const bdouble& arg2)
+{
+    //a tie goes to the constant
+    if(arg2.mValue == arg1)
+        return bdouble(arg1);
+    
+    return fmax(arg2,arg1);
+}
+
+bdouble fmin(const double& arg1, const bdouble& arg2)
+{
+    //a tie goes to the constant
+    if(arg2.mValue == arg1)
+        return bdouble(arg1);
+    
+    return fmin(arg2,arg1);
+}
+
+bdouble select(const bdouble& cond, const bdouble& arg1, const bdouble& arg2)
+{
+    vector<bdouble> args;
+    args.reserve(3);
+    args.push_back(cond);
+    args.push_back(arg1);
+    args.push_back(arg2);
+    
+    return bdouble::record_nary(selectv,args,(cond.mValue > 0) ? arg1.mValue : arg2.mValue);
+}
+
+bdouble smoothabs(const bdouble& in, const double& eps)
+{
+    bdouble::val_trace.push_back(in.mValue);
+    bdouble::val_trace.push_back(eps);
+    bdouble::val_trace.push_back(std::hypot(in.mValue,eps));
+    
+    bdouble res(bdouble::val_trace.back());
+    
+    bdouble::op_trace.push_back(smoothabsv);
+    bdouble::index_trace.push_back(in.mThisId);
+    bdouble::index_trace.push_back(res.mThisId);
+    
+    return res;
+}
+
+bdouble smoothmax(const bdouble& arg1, const bdouble& arg2, const double& eps)
+{
+    return (arg1 + arg2 + smoothabs(arg1 - arg2,eps))*0.5;
+}
+
+bdouble smoothmin(const bdouble& arg1, const bdouble& arg2, const double& eps)
+{
+    return (arg1 + arg2 - smoothabs(arg1 - arg2,eps))*0.5;
+}
+
+bdouble smoothselect(const bdouble& cond, const bdouble& arg1, const bdouble& arg2, const double& eps)
+{
+    return arg2 + (arg1 - arg2)*N(cond/eps);
+}
+
 bdouble ldexp(const bdouble& in, const int& exp)
 {
     return in*ldexp(1.0,exp);
 }
 
-void TE_multconst(const double& value,const double& coeff,vector<double>& output,size_t loc = 0)
+//constants of the kernels, in long double so that they
+//keep their precision in the extended kernels
+const long double ln2_ld = 0.693147180559945309417232121458176568L;
+const long double ln10_ld = 2.302585092994045684017991454684364208L;
+const long double two_sqrtpi_ld = 1.128379167095512573896158903121545172L;
+const long double sqrt1_2_ld = 0.707106781186547524400844362104849039L;
+
+template<class T>
+void TE_multconst(const T& value,const T& coeff,vector<T>& output,size_t loc = 0)
 {
     while(loc < 2)
     {
@@ -298,7 +591,8 @@ void TE_multconst(const double& value,const double& coeff,vector<double>& output
     }
 }
 
-void TE_sumconst(const double& value,const double& coeff,vector<double>& output,size_t loc = 0)
+template<class T>
+void TE_sumconst(const T& value,const T& coeff,vector<T>& output,size_t loc = 0)
 {
     while(loc < 2)
     {
@@ -311,7 +605,8 @@ void TE_sumconst(const double& value,const double& coeff,vector<double>& output,
     }
 }
 
-void TE_minusconst(const double& value,const double& coeff,vector<double>& output,size_t loc = 0)
+template<class T>
+void TE_minusconst(const T& value,const T& coeff,vector<T>& output,size_t loc = 0)
 {
     while(loc < 2)
     {
@@ -324,7 +619,8 @@ void TE_minusconst(const double& value,const double& coeff,vector<double>& outpu
     }
 }
 
-void TE_cos(const double& value,vector<double>& output,size_t loc = 0)
+template<class T>
+void TE_cos(const T& value,vector<T>& output,size_t loc = 0)
 {
     while(loc != output.size())
     {
@@ -341,7 +637,8 @@ void TE_cos(const double& value,vector<double>& output,size_t loc = 0)
     }
 }
 
-void TE_sin(const double& value,vector<double>& output,size_t loc = 0)
+template<class T>
+void TE_sin(const T& value,vector<T>& output,size_t loc = 0)
 {
     while(loc != output.size())
     {
@@ -358,7 +655,8 @@ void TE_sin(const double& value,vector<double>& output,size_t loc = 0)
     }
 }
 
-void TE_exp(const double& value,vector<double>& output,size_t loc = 0)
+template<class T>
+void TE_exp(const T& value,vector<T>& output,size_t loc = 0)
 {
     while(loc != output.size())
     {
@@ -371,11 +669,12 @@ void TE_exp(const double& value,vector<double>& output,size_t loc = 0)
     }
 }
 
-void TE_exp2(const double& value,vector<double>& output,size_t loc = 0)
+template<class T>
+void TE_exp2(const T& value,vector<T>& output,size_t loc = 0)
 {
     while(loc != output.size())
     {
-        double ratio = std::log(2.0);
+        T ratio = (T)ln2_ld;
         if(loc == 0)
             output[loc] = std::exp2(value);
         else
@@ -385,7 +684,8 @@ void TE_exp2(const double& value,vector<double>& output,size_t loc = 0)
     }
 }
 
-void TE_expm1(const double& value,vector<double>& output,size_t loc = 0)
+template<class T>
+void TE_expm1(const T& value,vector<T>& output,size_t loc = 0)
 {
     while(loc != output.size())
     {
@@ -400,7 +700,8 @@ void TE_expm1(const double& value,vector<double>& output,size_t loc = 0)
     }
 }
 
-void TE_pow(const double& value,const double& deg,vector<double>& output,size_t loc = 0)
+template<class T>
+void TE_pow(const T& value,const T& deg,vector<T>& output,size_t loc = 0)
 {
     if(output.size() && loc == 0)
     {
@@ -408,8 +709,8 @@ void TE_pow(const double& value,const double& deg,vector<double>& output,size_t
         loc++;
     }
     
-    double newDeg = deg - (double)loc;
-    double coeff = 1.0 + newDeg;
+    T newDeg = deg - (T)loc;
+    T coeff = 1.0 + newDeg;
     while(loc != output.size())
     {
         if(coeff)
@@ -421,7 +722,25 @@ void TE_pow(const double& value,const double& deg,vector<double>& output,size_t
     }
 }
 
-void TE_powint(const double& value,const double& deg,vector<double>& output,size_t loc = 0)
+//we use f'(X) = log(base)f(X)
+template<class T>
+void TE_powbase(const T& value,const T& base,vector<T>& output,size_t loc = 0)
+{
+    const T log_base = std::log(base);
+    
+    while(loc != output.size())
+    {
+        if(loc == 0)
+            output[loc] = std::pow(base,value);
+        else
+            output[loc] = log_base*output[loc-1];
+        
+        loc++;
+    }
+}
+
+template<class T>
+void TE_powint(const T& value,const T& deg,vector<T>& output,size_t loc = 0)
 {
     if(output.size() && loc == 0)
     {
@@ -430,7 +749,7 @@ void TE_powint(const double& value,const double& deg,vector<double>& output,size
     }
     
     int newDeg = (int)deg - (int)loc;
-    double coeff = 1.0 + newDeg;
+    T coeff = 1.0 + newDeg;
     while(loc != output.size())
     {
         if(coeff)
@@ -442,7 +761,7 @@ void TE_powint(const double& value,const double& deg,vector<double>& output,size
     }
     
     /*int degint = (int)deg - (int)loc + 1;
-    double value_inv = 1/value;
+    T value_inv = 1/value;
     
     while(loc != output.size())
     {
@@ -468,7 +787,8 @@ void TE_powint(const double& value,const double& deg,vector<double>& output,size
     }*/
 }
 
-void TE_inv(const double& value,vector<double>& output,size_t loc = 0)
+template<class T>
+void TE_inv(const T& value,vector<T>& output,size_t loc = 0)
 {
     while(loc != output.size())
     {
@@ -481,7 +801,8 @@ void TE_inv(const double& value,vector<double>& output,size_t loc = 0)
     }
 }
 
-void TE_log(const double& value,vector<double>& output,size_t loc = 0)
+template<class T>
+void TE_log(const T& value,vector<T>& output,size_t loc = 0)
 {
     while(loc != output.size())
     {
@@ -490,13 +811,14 @@ void TE_log(const double& value,vector<double>& output,size_t loc = 0)
         else if(loc == 1)
             output[loc] = 1/value;
         else
-            output[loc] = -((double)loc-1)*output[loc-1]*output[1];
+            output[loc] = -((T)loc-1)*output[loc-1]*output[1];
         
         loc++;
     }
 }
 
-void TE_log1p(const double& value,vector<double>& output,size_t loc = 0)
+template<class T>
+void TE_log1p(const T& value,vector<T>& output,size_t loc = 0)
 {
     while(loc != output.size())
     {
@@ -505,16 +827,17 @@ void TE_log1p(const double& value,vector<double>& output,size_t loc = 0)
         else if(loc == 1)
             output[loc] = 1/(value+1.0);
         else
-            output[loc] = -((double)loc-1)*output[loc-1]*output[1];
+            output[loc] = -((T)loc-1)*output[loc-1]*output[1];
         
         loc++;
     }
 }
 
-void TE_log10(const double& value,vector<double>& output,size_t loc = 0)
+template<class T>
+void TE_log10(const T& value,vector<T>& output,size_t loc = 0)
 {
-    const double value_inv = 1/value;
-    const double ratio = 1/M_LN10;
+    const T value_inv = 1/value;
+    const T ratio = 1/(T)ln10_ld;
     
     while(loc != output.size())
     {
@@ -525,17 +848,18 @@ void TE_log10(const double& value,vector<double>& output,size_t loc = 0)
             if(loc == 1)
                 output[loc] = ratio*value_inv;
             else
-                output[loc] = -((double)loc-1)*output[loc-1]*value_inv;
+                output[loc] = -((T)loc-1)*output[loc-1]*value_inv;
         }
         
         loc++;
     }
 }
 
-void TE_log2(const double& value,vector<double>& output,size_t loc = 0)
+template<class T>
+void TE_log2(const T& value,vector<T>& output,size_t loc = 0)
 {
-    const double value_inv = 1/value;
-    const double ratio = 1/M_LN2;
+    const T value_inv = 1/value;
+    const T ratio = 1/(T)ln2_ld;
     
     while(loc != output.size())
     {
@@ -546,14 +870,15 @@ void TE_log2(const double& value,vector<double>& output,size_t loc = 0)
             if(loc == 1)
                 output[loc] = ratio*value_inv;
             else
-                output[loc] = -((double)loc-1)*output[loc-1]*value_inv;
+                output[loc] = -((T)loc-1)*output[loc-1]*value_inv;
         }
         
         loc++;
     }
 }
 
-void TE_cosh(const double& value,vector<double>& output,size_t loc = 0)
+template<class T>
+void TE_cosh(const T& value,vector<T>& output,size_t loc = 0)
 {
     while(loc != output.size())
     {
@@ -568,7 +893,8 @@ void TE_cosh(const double& value,vector<double>& output,size_t loc = 0)
     }
 }
 
-void TE_sinh(const double& value,vector<double>& output,size_t loc = 0)
+template<class T>
+void TE_sinh(const T& value,vector<T>& output,size_t loc = 0)
 {
     while(loc != output.size())
     {
@@ -584,14 +910,15 @@ void TE_sinh(const double& value,vector<double>& output,size_t loc = 0)
 }
 
 //we use f''(X) + 2Xf'(X) = 0
-void TE_erf(const double& value,vector<double>& output,size_t loc = 0)
+template<class T>
+void TE_erf(const T& value,vector<T>& output,size_t loc = 0)
 {
     while(loc != output.size())
     {
         if(loc == 0)
             output[loc] = std::erf(value);
         else if(loc == 1)
-            output[loc] = exp(-value*value)*M_2_SQRTPI;
+            output[loc] = std::exp(-value*value)*(T)two_sqrtpi_ld;
         else if(loc == 2)
             output[loc] = -2*value*output[loc-1];
         else
@@ -602,14 +929,15 @@ void TE_erf(const double& value,vector<double>& output,size_t loc = 0)
 }
 
 //we use f''(X) + 2Xf'(X) = 0
-void TE_erfc(const double& value,vector<double>& output,size_t loc = 0)
+template<class T>
+void TE_erfc(const T& value,vector<T>& output,size_t loc = 0)
 {
     while(loc != output.size())
     {
         if(loc == 0)
             output[loc] = std::erfc(value);
         else if(loc == 1)
-            output[loc] = -exp(-value*value)*M_2_SQRTPI;
+            output[loc] = -std::exp(-value*value)*(T)two_sqrtpi_ld;
         else if(loc == 2)
             output[loc] = -2*value*output[loc-1];
         else
@@ -620,14 +948,15 @@ void TE_erfc(const double& value,vector<double>& output,size_t loc = 0)
 }
 
 //we use f''(X) + Xf'(X) = 0
-void TE_N(const double& value,vector<double>& output,size_t loc = 0)
+template<class T>
+void TE_N(const T& value,vector<T>& output,size_t loc = 0)
 {
     while(loc != output.size())
     {
         if(loc == 0)
-            output[loc] = 0.5*(1.0+std::erf(value*M_SQRT1_2));
+            output[loc] = 0.5*(1+std::erf(value*(T)sqrt1_2_ld));
         else if(loc == 1)
-            output[loc] = 0.5*M_2_SQRTPI*M_SQRT1_2*exp(-value*value*0.5);
+            output[loc] = 0.5*(T)two_sqrtpi_ld*(T)sqrt1_2_ld*std::exp(-value*value*0.5);
         else if(loc == 2)
             output[loc] = -value*output[loc-1];
         else
@@ -637,8 +966,26 @@ void TE_N(const double& value,vector<double>& output,size_t loc = 0)
     }
 }
 
+//we use f'(X) + Xf(X) = 0
+template<class T>
+void TE_npdf(const T& value,vector<T>& output,size_t loc = 0)
+{
+    while(loc != output.size())
+    {
+        if(loc == 0)
+            output[loc] = 0.5*(T)two_sqrtpi_ld*(T)sqrt1_2_ld*std::exp(-value*value*0.5);
+        else if(loc == 1)
+            output[loc] = -value*output[loc-1];
+        else
+            output[loc] = -value*output[loc-1] - ((int)loc-1)*output[loc-2];
+        
+        loc++;
+    }
+}
+
 //we use (X^2-1)f''(X) + Xf'(X) = 0
-void TE_acos(const double& value,vector<double>& output,size_t loc = 0)
+template<class T>
+void TE_acos(const T& value,vector<T>& output,size_t loc = 0)
 {
     if(output.size() && loc == 0)
     {
@@ -648,13 +995,13 @@ void TE_acos(const double& value,vector<double>& output,size_t loc = 0)
     
     if(loc != output.size())
     {
-        double denom = value*value - 1;
-        double one_over_denom = 1/denom;
+        T denom = value*value - 1;
+        T one_over_denom = 1/denom;
         
         while(loc != output.size())
         {
             if(loc == 1)
-                output[loc] = -sqrt(-one_over_denom);
+                output[loc] = -std::sqrt(-one_over_denom);
             else if(loc==2)
                 output[loc] = -value*output[loc-1]*one_over_denom;
             else if(loc==3)
@@ -672,7 +1019,8 @@ void TE_acos(const double& value,vector<double>& output,size_t loc = 0)
 }
 
 //we use (X^2-1)f''(X) + Xf'(X) = 0
-void TE_asin(const double& value,vector<double>& output,size_t loc = 0)
+template<class T>
+void TE_asin(const T& value,vector<T>& output,size_t loc = 0)
 {
     if(output.size() && loc == 0)
     {
@@ -682,13 +1030,13 @@ void TE_asin(const double& value,vector<double>& output,size_t loc = 0)
     
     if(loc != output.size())
     {
-        double denom = value*value - 1;
-        double one_over_denom = 1/denom;
+        T denom = value*value - 1;
+        T one_over_denom = 1/denom;
         
         while(loc != output.size())
         {
             if(loc == 1)
-                output[loc] = sqrt(-one_over_denom);
+                output[loc] = std::sqrt(-one_over_denom);
             else if(loc==2)
                 output[loc] = -value*output[loc-1]*one_over_denom;
             else if(loc==3)
@@ -706,7 +1054,8 @@ void TE_asin(const double& value,vector<double>& output,size_t loc = 0)
 }
 
 //we use (X^2-1)f''(X) + Xf'(X) = 0
-void TE_acosh(const double& value,vector<double>& output,size_t loc = 0)
+template<class T>
+void TE_acosh(const T& value,vector<T>& output,size_t loc = 0)
 {
     if(output.size() && loc == 0)
     {
@@ -716,13 +1065,13 @@ void TE_acosh(const double& value,vector<double>& output,size_t loc = 0)
     
     if(loc != output.size())
     {
-        double denom = value*value - 1;
-        double one_over_denom = 1/denom;
+        T denom = value*value - 1;
+        T one_over_denom = 1/denom;
         
         while(loc != output.size())
         {
             if(loc == 1)
-                output[loc] = sqrt(one_over_denom);
+                output[loc] = std::sqrt(one_over_denom);
             else if(loc==2)
                 output[loc] = -value*output[loc-1]*one_over_denom;
             else if(loc==3)
@@ -740,7 +1089,8 @@ void TE_acosh(const double& value,vector<double>& output,size_t loc = 0)
 }
 
 //we use (X^2+1)f''(X) + 2Xf'(X) = 0
-void TE_atan(const double& value,vector<double>& output,size_t loc = 0)
+template<class T>
+void TE_atan(const T& value,vector<T>& output,size_t loc = 0)
 {
     if(output.size() && loc == 0)
     {
@@ -750,8 +1100,8 @@ void TE_atan(const double& value,vector<double>& output,size_t loc = 0)
     
     if(loc != output.size())
     {
-        double denom = value*value + 1;
-        double one_over_denom = 1/denom;
+        T denom = value*value + 1;
+        T one_over_denom = 1/denom;
         
         while(loc != output.size())
         {
@@ -774,7 +1124,8 @@ void TE_atan(const double& value,vector<double>& output,size_t loc = 0)
 }
 
 //we use (X^2+1)f''(X) + Xf'(X) = 0
-void TE_asinh(const double& value,vector<double>& output,size_t loc = 0)
+template<class T>
+void TE_asinh(const T& value,vector<T>& output,size_t loc = 0)
 {
     if(output.size() && loc == 0)
     {
@@ -784,13 +1135,13 @@ void TE_asinh(const double& value,vector<double>& output,size_t loc = 0)
     
     if(loc != output.size())
     {
-        double denom = value*value + 1;
-        double one_over_denom = 1/denom;
+        T denom = value*value + 1;
+        T one_over_denom = 1/denom;
         
         while(loc != output.size())
         {
             if(loc == 1)
-                output[loc] = sqrt(one_over_denom);
+                output[loc] = std::sqrt(one_over_denom);
             else if(loc==2)
                 output[loc] = -value*output[loc-1]*one_over_denom;
             else if(loc==3)
@@ -808,7 +1159,8 @@ void TE_asinh(const double& value,vector<double>& output,size_t loc = 0)
 }
 
 //we use (X^2-1)f''(X) + 2Xf'(X) = 0
-void TE_atanh(const double& value,vector<double>& output,size_t loc = 0)
+template<class T>
+void TE_atanh(const T& value,vector<T>& output,size_t loc = 0)
 {
     if(output.size() && loc == 0)
     {
@@ -818,8 +1170,8 @@ void TE_atanh(const double& value,vector<double>& output,size_t loc = 0)
     
     if(loc != output.size())
     {
-        double denom = value*value - 1;
-        double one_over_denom = 1/denom;
+        T denom = value*value - 1;
+        T one_over_denom = 1/denom;
         
         while(loc != output.size())
         {
@@ -842,16 +1194,17 @@ void TE_atanh(const double& value,vector<double>& output,size_t loc = 0)
 }
 
 //we use f' = 1 + f^2
-void TE_tan(const double& value,vector<double>& output,size_t loc = 0)
+template<class T>
+void TE_tan(const T& value,vector<T>& output,size_t loc = 0)
 {
     if(loc == 0)
     {
-        output[loc] = tan(value);
+        output[loc] = std::tan(value);
         loc++;
     }
     
-    double fval = output[0];
-    double fval_sq = fval*fval;
+    T fval = output[0];
+    T fval_sq = fval*fval;
     
     vector<int> fval_coeffs(output.size()+1,0);
     fval_coeffs[1] = 1;
@@ -873,7 +1226,7 @@ void TE_tan(const double& value,vector<double>& output,size_t loc = 0)
         }
         odd = !odd;
         
-        double fval_der = 0;
+        T fval_der = 0;
         for(size_t i = (loc+1); i > (size_t)odd; i-=2)
         {
             fval_der += fval_coeffs[i];
@@ -891,16 +1244,17 @@ void TE_tan(const double& value,vector<double>& output,size_t loc = 0)
 }
 
 //we use f' = 1 - f^2
-void TE_tanh(const double& value,vector<double>& output,size_t loc = 0)
+template<class T>
+void TE_tanh(const T& value,vector<T>& output,size_t loc = 0)
 {
     if(loc == 0)
     {
-        output[loc] = tanh(value);
+        output[loc] = std::tanh(value);
         loc++;
     }
     
-    double fval = output[0];
-    double fval_sq = fval*fval;
+    T fval = output[0];
+    T fval_sq = fval*fval;
     
     vector<int> fval_coeffs(output.size()+1,0);
     fval_coeffs[1] = 1;
@@ -922,7 +1276,7 @@ void TE_tanh(const double& value,vector<double>& output,size_t loc = 0)
         }
         odd = !odd;
         
-        double fval_der = 0;
+        T fval_der = 0;
         for(size_t i = (loc+1); i > (size_t)odd; i-=2)
         {
             fval_der += fval_coeffs[i];
@@ -939,12 +1293,13 @@ void TE_tanh(const double& value,vector<double>& output,size_t loc = 0)
     }
 }
 
-void TE_lgamma(const double& value,vector<double>& output,size_t loc = 0)
+template<class T>
+void TE_lgamma(const T& value,vector<T>& output,size_t loc = 0)
 {
     while(loc != output.size())
     {
         if(loc == 0)
-            output[loc] = lgamma(value);
+            output[loc] = std::lgamma(value);
         else
             output[loc] = boost::math::polygamma(((int)loc-1),value);
         
@@ -952,7 +1307,51 @@ void TE_lgamma(const double& value,vector<double>& output,size_t loc = 0)
     }
 }
 
-void TE_tgamma(const double& value,vector<double>& output,size_t loc = 0)
+//sum over the partitions of n of multiplicity * prod values[part],
+//also split by number of parts when sums is given. partitions
+//come from the table when it goes that far.
+template<class T>
+T TE_partitions(const size_t& n,const vector<T>& values,T* sums = 0)
+{
+    T total = 0;
+    if(n <= ADHOC_PARTITIONS_MAX)
+    {
+        vector<partitionEntry> buffer;
+        const vector<partitionEntry>& parts = partitions(n,buffer);
+        for(size_t k = 0; k < parts.size(); k++)
+        {
+            const vector<size_t>& part = parts[k].parts;
+            T temp = parts[k].multiplicity;
+            for(size_t j = 0; j < part.size(); j++)
+                temp *= values[part[j]];
+            
+            total += temp;
+            if(sums)
+                sums[part.size()-1] += temp;
+        }
+    }
+    else
+    {
+        array<size_t,ADHOC_FIXED_MAX_ORDER> part;
+        size_t size;
+        partitionGeneratorFixed<ADHOC_FIXED_MAX_ORDER> pg(n);
+        while(pg.next(part,size))
+        {
+            T temp = pg.multiplicity(part,size);
+            for(size_t j = 0; j < size; j++)
+                temp *= values[part[j]];
+            
+            total += temp;
+            if(sums)
+                sums[size-1] += temp;
+        }
+    }
+    
+    return total;
+}
+
+template<class T>
+void TE_tgamma(const T& value,vector<T>& output,size_t loc = 0)
 {
     if(loc == 0)
     {
@@ -963,421 +1362,775 @@ void TE_tgamma(const double& value,vector<double>& output,size_t loc = 0)
     TE_lgamma(value,output,loc);
     
     for(size_t i = (output.size()-1); i >= loc; i--)
-    {
-        double der = 0;
-        vector<size_t> part;
-        partitionGenerator pg(i);
-        while(pg.next(part))
-        {
-            double temp = pg.multiplicity(part);
-            for(size_t j = 0; j < part.size(); j++)
-                temp *= output[part[j]];
-            
-            der += temp;
-        }
-        
-        output[i] = der*output[0];
-    }
+        output[i] = TE_partitions(i,output)*output[0];
 }
 
-const double& bdouble::get(const vector<size_t>& idxes) const
+template<class T>
+void TE_sqrt(const T& value,vector<T>& output,size_t loc = 0)
 {
-    return mCoeff[multisetcount(idxes, mOrder)];
+    TE_pow<T>(value,0.5,output,loc);
 }
 
-double& bdouble::get(const vector<size_t>& idxes)
+//piecewise linear functions, the derivative is the one
+//of the side the value falls on
+template<class T>
+void TE_fabs(const T& value,vector<T>& output,size_t loc = 0)
 {
-    return mCoeff[multisetcount(idxes, mOrder)];
+    while(loc != output.size())
+    {
+        if(loc == 0)
+            output[loc] = std::fabs(value);
+        else if(loc == 1)
+            output[loc] = (value >= 0) ? 1 : -1;
+        else
+            output[loc] = 0;
+        
+        loc++;
+    }
 }
 
-double bdouble::der(const vector<size_t>& id,const vector<size_t>& order)
+template<class T>
+void TE_fmaxconst(const T& value,const T& bound,vector<T>& output,size_t loc = 0)
 {
-    if(mCoeff.empty())
-        run_tape();
-    
-    //they should be the same size
-    if(order.size() != id.size())
-        throw;
-    
-    vector<size_t> idxes(mId.size()+1,0);
-    idxes[0] = mOrder;
-    
-    for(size_t i = 0; i < order.size(); i++)
-        if (!addDer(idxes,id[i],order[i])) return 0;
-    
-    return get(idxes);
+    while(loc != output.size())
+    {
+        if(loc == 0)
+            output[loc] = (value >= bound) ? value : bound;
+        else if(loc == 1)
+            output[loc] = (value >= bound) ? 1 : 0;
+        else
+            output[loc] = 0;
+        
+        loc++;
+    }
 }
 
-bool bdouble::addDer(vector<size_t>& idxes,const size_t& var_id,const size_t& order) const
+template<class T>
+void TE_fminconst(const T& value,const T& bound,vector<T>& output,size_t loc = 0)
 {
-    vector<size_t>::const_iterator it;
-    it = find(mId.begin(), mId.end(), var_id);
-    if (it != mId.end())
+    while(loc != output.size())
     {
-        if(order > idxes[0])
-            throw;
+        if(loc == 0)
+            output[loc] = (value <= bound) ? value : bound;
+        else if(loc == 1)
+            output[loc] = (value <= bound) ? 1 : 0;
+        else
+            output[loc] = 0;
         
-        idxes[distance(mId.begin(),it)+1] += order;
-        idxes[0] -= order;
+        loc++;
+    }
+}
+
+//we use f^2 = X^2 + eps^2 differentiated with leibniz rule
+template<class T>
+void TE_smoothabs(const T& value,const T& eps,vector<T>& output,size_t loc = 0)
+{
+    while(loc != output.size())
+    {
+        if(loc == 0)
+            output[loc] = std::sqrt(value*value + eps*eps);
+        else if(loc == 1)
+            output[loc] = value/output[0];
+        else
+        {
+            T der = (loc == 2) ? 1 : 0;
+            T binom = 1;
+            for(size_t k = 1; k < loc; k++)
+            {
+                binom = binom*(loc-k+1)/k;
+                der -= 0.5*binom*output[k]*output[loc-k];
+            }
+            
+            output[loc] = der/output[0];
+        }
         
-        return true;
+        loc++;
     }
-    else
-        return false;
 }
 
-double bdouble::der_aux(size_t& var_id, vector<size_t>& idxes) const
+taylorPolynomial TE_compose(const taylorPolynomial& in,void (*kernel)(const kdouble&,vector<kdouble>&,size_t))
 {
-    //this means that the previous argument had an implied order of 1
-    if(var_id != -1)
-        if (!addDer(idxes,var_id,1)) return 0;
+    vector<kdouble> taylorexp(in.order()+1);
+    kernel(in.value(),taylorexp,0);
     
-    return get(idxes);
+    return in.compose(taylorexp);
 }
 
-void bdouble::run_tape(const size_t orderOverride)
+//F N(d1) - K N(d2) with d1 = log(F/K)/stdev + stdev/2,
+//d2 = d1 - stdev and stdev = sigma sqrt(T)
+taylorPolynomial TE_blackscholes(const vector<double>& values,const size_t& order)
 {
-    if(orderOverride == -1)
-        mOrder = mDefaultOrder;
-    else
-        mOrder = orderOverride;
+    taylorPolynomial F = taylorPolynomial::variable(4,order,0,values[0]);
+    taylorPolynomial K = taylorPolynomial::variable(4,order,1,values[1]);
+    taylorPolynomial sigma = taylorPolynomial::variable(4,order,2,values[2]);
+    taylorPolynomial T = taylorPolynomial::variable(4,order,3,values[3]);
     
-    if(mOrder == 0)
-        throw;
+    taylorPolynomial stdev = sigma*TE_compose(T,TE_sqrt<kdouble>);
+    taylorPolynomial d1 = (TE_compose(F,TE_log<kdouble>) - TE_compose(K,TE_log<kdouble>))*TE_compose(stdev,TE_inv<kdouble>) + stdev*0.5;
+    taylorPolynomial d2 = d1 - stdev;
     
-    //initially I overestimate the number of free slots
-    //I will need for my calculation at the number
-    //of variables used.
-    deque<size_t> free_slots(indexcount);
-    for(size_t i=0;i<indexcount;i++)
-        free_slots[i] = i;
+    return F*TE_compose(d1,TE_N<kdouble>) - K*TE_compose(d2,TE_N<kdouble>);
+}
+
+//npdf(z)/(x sigma) with z = (log(x) - mu)/sigma
+taylorPolynomial TE_lognpdf(const vector<double>& values,const size_t& order)
+{
+    taylorPolynomial x = taylorPolynomial::variable(3,order,0,values[0]);
+    taylorPolynomial mu = taylorPolynomial::variable(3,order,1,values[1]);
+    taylorPolynomial sigma = taylorPolynomial::variable(3,order,2,values[2]);
     
-    vector<bool> op_relevant(op_trace.size(),false);
-    vector<bool>::reverse_iterator op_relevant_rev_it = op_relevant.rbegin();
-    vector<size_t>::const_reverse_iterator op_trace_rev_it = op_trace.rbegin();
-    vector<size_t>::const_reverse_iterator index_trace_rev_it = index_trace.rbegin();
+    taylorPolynomial z = (TE_compose(x,TE_log<kdouble>) - mu)*TE_compose(sigma,TE_inv<kdouble>);
     
-    vector<size_t> id_slot_map(indexcount,-1);
-    vector<size_t> slot_id_map(indexcount,-1);
+    return TE_compose(z,TE_npdf<kdouble>)*TE_compose(x*sigma,TE_inv<kdouble>);
+}
+
+//exp(y log(x))
+taylorPolynomial TE_powb(const vector<double>& values,const size_t& order)
+{
+    taylorPolynomial x = taylorPolynomial::variable(2,order,0,values[0]);
+    taylorPolynomial y = taylorPolynomial::variable(2,order,1,values[1]);
     
-    size_t max_nvar = 1;
-    size_t current_nvar = 0;
+    return TE_compose(y*TE_compose(x,TE_log<kdouble>),TE_exp<kdouble>);
+}
+
+//atan2(y,x) is atan(y/x) or -atan(x/y) up to a constant,
+//we pick the ratio that stays bounded
+taylorPolynomial TE_atan2(const vector<double>& values,const size_t& order)
+{
+    taylorPolynomial y = taylorPolynomial::variable(2,order,0,values[0]);
+    taylorPolynomial x = taylorPolynomial::variable(2,order,1,values[1]);
     
-    vector<bool> var_concerned(indexcount,false);
-    var_concerned[mThisId] = true;
+    taylorPolynomial res(2,order);
+    if(std::fabs(values[1]) >= std::fabs(values[0]))
+        res = TE_compose(y*TE_compose(x,TE_inv<kdouble>),TE_atan<kdouble>);
+    else
+        res = TE_compose(x*TE_compose(y,TE_inv<kdouble>),TE_atan<kdouble>)*(-1);
     
-    id_slot_map[mThisId] = free_slots.front();
-    slot_id_map[free_slots.front()] = mThisId;
-    free_slots.pop_front();
-    current_nvar++;
+    res.value() = std::atan2(values[0],values[1]);
     
-    size_t res,arg1,arg2;
+    return res;
+}
+
+taylorPolynomial TE_hypot(const vector<double>& values,const size_t& order)
+{
+    taylorPolynomial x = taylorPolynomial::variable(2,order,0,values[0]);
+    taylorPolynomial y = taylorPolynomial::variable(2,order,1,values[1]);
     
-    for (; op_trace_rev_it!= op_trace.rend(); ++op_trace_rev_it,++op_relevant_rev_it)
+    return TE_compose(x*x + y*y,TE_sqrt<kdouble>);
+}
+
+taylorPolynomial TE_fma(const vector<double>& values,const size_t& order)
+{
+    taylorPolynomial x = taylorPolynomial::variable(3,order,0,values[0]);
+    taylorPolynomial y = taylorPolynomial::variable(3,order,1,values[1]);
+    taylorPolynomial z = taylorPolynomial::variable(3,order,2,values[2]);
+    
+    return x*y + z;
+}
+
+//the branch taken is a polynomial of degree 1
+//in one of the arguments
+taylorPolynomial TE_fmax(const vector<double>& values,const size_t& order)
+{
+    if(values[0] >= values[1])
+        return taylorPolynomial::variable(2,order,0,values[0]);
+    else
+        return taylorPolynomial::variable(2,order,1,values[1]);
+}
+
+taylorPolynomial TE_fmin(const vector<double>& values,const size_t& order)
+{
+    if(values[0] <= values[1])
+        return taylorPolynomial::variable(2,order,0,values[0]);
+    else
+        return taylorPolynomial::variable(2,order,1,values[1]);
+}
+
+taylorPolynomial TE_select(const vector<double>& values,const size_t& order)
+{
+    if(values[0] > 0)
+        return taylorPolynomial::variable(3,order,1,values[1]);
+    else
+        return taylorPolynomial::variable(3,order,2,values[2]);
+}
+
+//taylor expansion of an op of several arguments
+//in all its arguments
+taylorPolynomial TE_nary(const size_t& op,const vector<double>& values,const size_t& order)
+{
+    switch(op)
     {
-        res = *index_trace_rev_it++;
-        if(var_concerned[res])
-        {
-            *op_relevant_rev_it = true;
-            
-            size_t res_pos = id_slot_map[res];
-            free_slots.push_front(res_pos);
-            slot_id_map[res_pos] = -1;
-            id_slot_map[res] = -1;
-            current_nvar--;
-            
-            arg1 = *index_trace_rev_it++;
-            var_concerned[arg1] = true;
-            if(id_slot_map[arg1] == -1)
-            {
-                id_slot_map[arg1] = free_slots.front();
-                slot_id_map[free_slots.front()] = arg1;
-                free_slots.pop_front();
-                current_nvar++;
-            }
-            
-            //if it's a function of 2 variables,
-            //we have to take into account the second variable
-            if(*op_trace_rev_it == bmultv ||
-               *op_trace_rev_it == bplusv ||
-               *op_trace_rev_it == bminusv)
-            {
-                arg1 = *index_trace_rev_it++;
-                var_concerned[arg1] = true;
-                if(id_slot_map[arg1] == -1)
-                {
-                    id_slot_map[arg1] = free_slots.front();
-                    slot_id_map[free_slots.front()] = arg1;
-                    free_slots.pop_front();
-                    current_nvar++;
-                }
-            }
-            
-            max_nvar = max(current_nvar,max_nvar);
-        }
-        else
-        {
-            index_trace_rev_it++;
-            
-            //if it's a function of 2 variables,
-            //we have to take into account the second variable
-            if(*op_trace_rev_it == bmultv ||
-               *op_trace_rev_it == bplusv ||
-               *op_trace_rev_it == bminusv)
-                index_trace_rev_it++;
-        }
+        case blackscholesv:
+            return TE_blackscholes(values,order);
+        case lognpdfv:
+            return TE_lognpdf(values,order);
+        case atan2v:
+            return TE_atan2(values,order);
+        case hypotv:
+            return TE_hypot(values,order);
+        case fmav:
+            return TE_fma(values,order);
+        case powbv:
+            return TE_powb(values,order);
+        case fmaxv:
+            return TE_fmax(values,order);
+        case fminv:
+            return TE_fmin(values,order);
+        case selectv:
+            return TE_select(values,order);
     }
     
-    //we are now going to fill the free slots so that
-    //at the end of the run all the initial ids will
-    //fall ordered in the first mCoeff slots
-    free_slots.clear();
-    free_slots.resize(max_nvar);
-    
-    slot_id_map.erase (slot_id_map.begin()+max_nvar,slot_id_map.end());
-    
-    //here we fill the slots that correspond to initial variables
-    //starting from 0
-    size_t slot = 0;
-    for(vector<size_t>::const_iterator id_slot_map_it = id_slot_map.begin(); id_slot_map_it != id_slot_map.end(); id_slot_map_it++)
+    throw std::invalid_argument("TE_nary: not an n-ary op");
+}
+
+//number of bdouble arguments of an op
+size_t op_arity(const size_t& op)
+{
+    switch(op)
     {
-        if(*id_slot_map_it != -1)
-        {
-            free_slots[*id_slot_map_it] = slot;
-            slot++;
-        }
+        case bplusv:
+        case bminusv:
+        case bmultv:
+        case atan2v:
+        case hypotv:
+        case powbv:
+        case fmaxv:
+        case fminv:
+            return 2;
+        case lognpdfv:
+        case fmav:
+        case selectv:
+            return 3;
+        case blackscholesv:
+            return 4;
+        default:
+            return 1;
     }
-    
-    //here we fill the rest of the slots so that we have
-    //max_nvar slots from 0 to (max_nvar-1)
-    for(vector<size_t>::iterator slot_id_map_it = slot_id_map.begin(); slot_id_map_it != slot_id_map.end(); slot_id_map_it++)
+}
+
+//number of values recorded by an op
+size_t op_vals(const size_t& op)
+{
+    switch(op)
     {
-        if(*slot_id_map_it == -1)
-        {
-            free_slots[distance(slot_id_map.begin(),slot_id_map_it)] = slot;
-            slot++;
-        }
+        case bplusv:
+        case bminusv:
+            return 0;
+        case sumconstv:
+        case minusconstv:
+        case expv:
+        case exp2v:
+        case invv:
+        case tanv:
+        case tanhv:
+            return 1;
+        case powv:
+        case powintv:
+        case powbasev:
+        case fmaxconstv:
+        case fminconstv:
+        case smoothabsv:
+            return 3;
+        case blackscholesv:
+        case lognpdfv:
+        case atan2v:
+        case hypotv:
+        case fmav:
+        case powbv:
+        case fmaxv:
+        case fminv:
+        case selectv:
+            return op_arity(op)+1;
+        default:
+            return 2;
     }
+}
+
+//first derivative of a unary op, the iterator points to the
+//result and is moved past the values recorded by the op
+double der_unary(const size_t& op,chunkedVector<double>::const_reverse_iterator& val_trace_rev_it)
+{
+    double result = *val_trace_rev_it++;
     
-    slot_id_map.clear();
-    std::fill (id_slot_map.begin(),id_slot_map.end(),-1);
-    
-    mCoeff.resize(multisetcoeff(max_nvar+1,mOrder));
-    mCoeff[0] = mValue;
-    
-    vector<size_t> idxes;
-    idxes.clear();
-    idxes.resize(free_slots.size()+1,0);
-    idxes[0] = mOrder;
-    
-    mId.clear();
-    mId.resize(free_slots.size(),-1);
-    
-    id_slot_map[mThisId] = free_slots.front();
-    mId[free_slots.front()] = mThisId;
-    free_slots.pop_front();
-    idxes[0]--;
-    idxes[id_slot_map[mThisId]+1]++;
-    get(idxes) = 1.0;
-    idxes[0]++;
-    idxes[id_slot_map[mThisId]+1]--;
-    
-    op_relevant_rev_it = op_relevant.rbegin();
-    op_trace_rev_it = op_trace.rbegin();
-    index_trace_rev_it = index_trace.rbegin();
-    vector<double>::const_reverse_iterator val_trace_rev_it = val_trace.rbegin();
-    
-    vector<size_t> idxes_sparse;
-    
-    for (; op_trace_rev_it!= op_trace.rend(); ++op_trace_rev_it,++op_relevant_rev_it)
-        switch(*op_trace_rev_it)
+    switch(op)
     {
         case multconstv:
+            return *val_trace_rev_it++;
         case sumconstv:
+            return 1;
         case minusconstv:
+            return -1;
         case cosv:
+            return -sin(*val_trace_rev_it++);
         case sinv:
+            return cos(*val_trace_rev_it++);
         case expv:
+            return result;
         case exp2v:
+            return std::log(2.0)*result;
         case expm1v:
+            return exp(*val_trace_rev_it++);
         case powv:
         case powintv:
+        {
+            double deg = *val_trace_rev_it++;
+            return deg*pow((*val_trace_rev_it++),deg-1);
+        }
+        case powbasev:
+        {
+            double base = *val_trace_rev_it++;
+            val_trace_rev_it++;
+            return result*std::log(base);
+        }
         case invv:
+            return -result*result;
         case logv:
+            return 1/(*val_trace_rev_it++);
         case log1pv:
+            return 1/((*val_trace_rev_it++)+1);
         case log10v:
+            return 1/(M_LN10*(*val_trace_rev_it++));
         case log2v:
+            return 1/(M_LN2*(*val_trace_rev_it++));
         case coshv:
+            return sinh(*val_trace_rev_it++);
         case sinhv:
+            return cosh(*val_trace_rev_it++);
         case erfv:
+        {
+            double value = *val_trace_rev_it++;
+            return M_2_SQRTPI*exp(-value*value);
+        }
         case erfcv:
+        {
+            double value = *val_trace_rev_it++;
+            return -M_2_SQRTPI*exp(-value*value);
+        }
         case nv:
+        {
+            double value = *val_trace_rev_it++;
+            return 0.5*M_2_SQRTPI*M_SQRT1_2*exp(-value*value*0.5);
+        }
+        case npdfv:
+            return -result*(*val_trace_rev_it++);
         case tanv:
+            return 1 + result*result;
         case tanhv:
+            return 1 - result*result;
         case acosv:
+        {
+            double value = *val_trace_rev_it++;
+            return -1/sqrt(1-value*value);
+        }
         case asinv:
+        {
+            double value = *val_trace_rev_it++;
+            return 1/sqrt(1-value*value);
+        }
         case atanv:
+        {
+            double value = *val_trace_rev_it++;
+            return 1/(1+value*value);
+        }
         case acoshv:
+        {
+            double value = *val_trace_rev_it++;
+            return 1/sqrt(value*value-1);
+        }
         case asinhv:
+        {
+            double value = *val_trace_rev_it++;
+            return 1/sqrt(1+value*value);
+        }
         case atanhv:
+        {
+            double value = *val_trace_rev_it++;
+            return 1/(1-value*value);
+        }
         case lgammav:
+            return boost::math::polygamma(0,*val_trace_rev_it++);
         case tgammav:
-            
-            if(*op_relevant_rev_it)
-            {
-                res = *index_trace_rev_it++;
-                size_t res_pos = id_slot_map[res];
-                
-                free_slots.push_front(res_pos);
-                mId[res_pos] = -1;
-                id_slot_map[res] = -1;
-                
-                arg1 = *index_trace_rev_it++;
-                
-                //second case works always, first case is faster
-                if (mOrder == 1)
-                {
-                    if(id_slot_map[arg1] == -1)
-                    {
-                        id_slot_map[arg1] = free_slots.front();
-                        mId[free_slots.front()] = arg1;
-                        free_slots.pop_front();
-                    }
-                    size_t arg_pos = id_slot_map[arg1];
-                    
-                    double temp = mCoeff[res_pos+1];
-                    mCoeff[res_pos+1] = 0;
-                    
-                    double result = *val_trace_rev_it++;
-                    
-                    switch(*op_trace_rev_it)
-                    {
-                        case multconstv:
-                        {
-                            double coeff = *val_trace_rev_it++;
-                            mCoeff[arg_pos+1] += temp*coeff;
-                            break;
-                        }
-                        case sumconstv:
-                        {
-                            mCoeff[arg_pos+1] += temp;
-                            break;
-                        }
-                        case minusconstv:
-                        {
-                            mCoeff[arg_pos+1] -= temp;
-                            break;
-                        }
-                        case cosv:
-                            mCoeff[arg_pos+1] -= temp*sin((*val_trace_rev_it++));
-                            break;
-                        case sinv:
-                            mCoeff[arg_pos+1] += temp*cos((*val_trace_rev_it++));
-                            break;
-                        case expv:
-                            mCoeff[arg_pos+1] += temp*result;
-                            break;
-                        case exp2v:
-                            mCoeff[arg_pos+1] += temp*std::log(2.0)*result;
-                            break;
-                        case expm1v:
-                            mCoeff[arg_pos+1] += temp*exp((*val_trace_rev_it++));
-                            break;
-                        case powv:
-                        case powintv:
-                        {
-                            double deg = *val_trace_rev_it++;
-                            mCoeff[arg_pos+1] += temp*deg*pow((*val_trace_rev_it++),deg-1);
-                            break;
-                        }
-                        case invv:
-                            mCoeff[arg_pos+1] -= temp*result*result;
-                            break;
-                        case logv:
-                            mCoeff[arg_pos+1] += temp/(*val_trace_rev_it++);
-                            break;
-                        case log1pv:
-                            mCoeff[arg_pos+1] += temp/((*val_trace_rev_it++)+1);
-                            break;
-                        case log10v:
-                            mCoeff[arg_pos+1] += temp/(M_LN10*(*val_trace_rev_it++));
-                            break;
-                        case log2v:
-                            mCoeff[arg_pos+1] += temp/(M_LN2*(*val_trace_rev_it++));
-                            break;
-                        case coshv:
-                            mCoeff[arg_pos+1] += temp*sinh((*val_trace_rev_it++));
-                            break;
-                        case sinhv:
-                            mCoeff[arg_pos+1] += temp*cosh((*val_trace_rev_it++));
-                            break;
-                        case erfv:
-                        {
-                            double value = *val_trace_rev_it++;
-                            mCoeff[arg_pos+1] += temp*M_2_SQRTPI*exp(-value*value);
-                            break;
-                        }
-                        case erfcv:
-                        {
-                            double value = *val_trace_rev_it++;
-                            mCoeff[arg_pos+1] -= temp*M_2_SQRTPI*exp(-value*value);
-                            break;
-                        }
-                        case nv:
-                        {
-                            double value = *val_trace_rev_it++;
-                            mCoeff[arg_pos+1] += temp*0.5*M_2_SQRTPI*M_SQRT1_2*exp(-value*value*0.5);
-                            break;
-                        }
-                        case tanv:
-                            mCoeff[arg_pos+1] += temp*(1 + result*result);
-                            break;
-                        case tanhv:
-                            mCoeff[arg_pos+1] += temp*(1 - result*result);
-                            break;
-                        case acosv:
-                        {
-                            double value = *val_trace_rev_it++;
-                            mCoeff[arg_pos+1] -= temp/sqrt(1-value*value);
-                            break;
-                        }
-                        case asinv:
-                        {
-                            double value = *val_trace_rev_it++;
-                            mCoeff[arg_pos+1] += temp/sqrt(1-value*value);
-                            break;
-                        }
-                        case atanv:
-                        {
-                            double value = *val_trace_rev_it++;
-                            mCoeff[arg_pos+1] += temp/(1+value*value);
-                            break;
-                        }
-                        case acoshv:
-                        {
-                            double value = *val_trace_rev_it++;
-                            mCoeff[arg_pos+1] += temp/sqrt(value*value-1);
-                            break;
-                        }
-                        case asinhv:
-                        {
-                            double value = *val_trace_rev_it++;
-                            mCoeff[arg_pos+1] += temp/sqrt(1+value*value);
-                            break;
-                        }
-                        case atanhv:
-                        {
-                            double value = *val_trace_rev_it++;
-                            mCoeff[arg_pos+1] += temp/(1-value*value);
-                            break;
-                        }
-                        case lgammav:
-                            mCoeff[arg_pos+1] += temp*boost::math::polygamma(0,*val_trace_rev_it++);
-                            break;
-                        case tgammav:
-                            mCoeff[arg_pos+1] += temp*result*boost::math::polygamma(0,*val_trace_rev_it++);
-                            break;
+            return result*boost::math::polygamma(0,*val_trace_rev_it++);
+        case fabsv:
+            return ((*val_trace_rev_it++) >= 0) ? 1 : -1;
+        case fmaxconstv:
+        {
+            double bound = *val_trace_rev_it++;
+            return ((*val_trace_rev_it++) >= bound) ? 1 : 0;
+        }
+        case fminconstv:
+        {
+            double bound = *val_trace_rev_it++;
+            return ((*val_trace_rev_it++) <= bound) ? 1 : 0;
+        }
+        case smoothabsv:
+            val_trace_rev_it++;
+            return (*val_trace_rev_it++)/result;
+    }
+    
+    throw;
+}
+
+const double& bdouble::get(const vector<size_t>& idxes) const
+{
+    return mCoeff[multisetcount(idxes, mOrder)];
+}
+
+double& bdouble::get(const vector<size_t>& idxes)
+{
+    return mCoeff[multisetcount(idxes, mOrder)];
+}
+
+double bdouble::der(const vector<size_t>& id,const vector<size_t>& order)
+{
+    if(mCoeff.empty())
+        run_tape();
+    
+    //they should be the same size
+    if(order.size() != id.size())
+        throw;
+    
+    vector<size_t> idxes(mId.size()+1,0);
+    idxes[0] = mOrder;
+    
+    for(size_t i = 0; i < order.size(); i++)
+        if (!addDer(idxes,id[i],order[i])) return 0;
+    
+    return get(idxes);
+}
+
+vector<double> bdouble::tensor(const vector<bdouble>& vars,const size_t& order)
+{
+    if(mCoeff.empty())
+        run_tape();
+    
+    if(order > mOrder)
+        throw std::invalid_argument("tensor: order higher than the one run");
+    
+    vector<double> res;
+    if(vars.empty())
+        return res;
+    
+    res.reserve(multisetcoeff(vars.size(),order));
+    
+    //slots of the variables we depend on, through
+    //a sorted copy of mId
+    vector<pair<size_t,size_t> > id_slots(mId.size());
+    for(size_t i = 0; i < mId.size(); i++)
+        id_slots[i] = make_pair(mId[i],i);
+    sort(id_slots.begin(), id_slots.end());
+    
+    vector<size_t> positions;
+    vector<bool> present(vars.size(),false);
+    for(size_t i = 0; i < vars.size(); i++)
+    {
+        vector<pair<size_t,size_t> >::const_iterator it = lower_bound(id_slots.begin(), id_slots.end(), make_pair(vars[i].id(),(size_t)0));
+        if(it != id_slots.end() && it->first == vars[i].id())
+        {
+            positions.push_back(it->second+1);
+            present[i] = true;
+        }
+    }
+    
+    //all the coefficients we want are moves from idxes[0]
+    multisetRanker ranker(mId.size()+1,mOrder,positions);
+    vector<size_t> idxes(mId.size()+1,0);
+    idxes[0] = mOrder;
+    ranker.set(idxes);
+    
+    vector<size_t> moved(positions.size()+1);
+    multisetGenerator mg(vars.size(),order);
+    while(mg.next(idxes))
+    {
+        bool depends = true;
+        size_t j = 0;
+        for(size_t i = 0; i < vars.size(); i++)
+        {
+            if(present[i])
+                moved[j++] = idxes[i];
+            else if(idxes[i] != 0)
+                depends = false;
+        }
+        
+        res.push_back(depends ? mCoeff[ranker.rank(moved.data())] : 0);
+    }
+    
+    return res;
+}
+
+bool bdouble::addDer(vector<size_t>& idxes,const size_t& var_id,const size_t& order) const
+{
+    vector<size_t>::const_iterator it;
+    it = find(mId.begin(), mId.end(), var_id);
+    if (it != mId.end())
+    {
+        if(order > idxes[0])
+            throw;
+        
+        idxes[distance(mId.begin(),it)+1] += order;
+        idxes[0] -= order;
+        
+        return true;
+    }
+    else
+        return false;
+}
+
+double bdouble::der_aux(size_t& var_id, vector<size_t>& idxes) const
+{
+    //this means that the previous argument had an implied order of 1
+    if(var_id != -1)
+        if (!addDer(idxes,var_id,1)) return 0;
+    
+    return get(idxes);
+}
+
+//gives a slot to each id as the liveness pass walks the tape
+//backwards, the slot of a result is freed before its arguments
+//take theirs
+struct slotAllocator
+{
+    slotAllocator(deque<size_t>& free_slots_in,vector<size_t>& id_slot_map_in,vector<size_t>& slot_id_map_in)
+        : free_slots(free_slots_in), id_slot_map(id_slot_map_in), slot_id_map(slot_id_map_in), current_nvar(0), max_nvar(1) {}
+    
+    void result(const size_t& res)
+    {
+        size_t res_pos = id_slot_map[res];
+        free_slots.push_front(res_pos);
+        slot_id_map[res_pos] = -1;
+        id_slot_map[res] = -1;
+        current_nvar--;
+    }
+    
+    void argument(const size_t& arg)
+    {
+        if(id_slot_map[arg] == size_t(-1))
+        {
+            id_slot_map[arg] = free_slots.front();
+            slot_id_map[free_slots.front()] = arg;
+            free_slots.pop_front();
+            current_nvar++;
+            max_nvar = max(current_nvar,max_nvar);
+        }
+    }
+    
+    deque<size_t>& free_slots;
+    vector<size_t>& id_slot_map;
+    vector<size_t>& slot_id_map;
+    size_t current_nvar;
+    size_t max_nvar;
+};
+
+template<class Visitor>
+void bdouble::relevant_ops(const size_t& id,vector<bool>& op_relevant,vector<bool>& var_concerned,Visitor& visitor)
+{
+    op_relevant.assign(op_trace.size(),false);
+    var_concerned.assign(indexcount,false);
+    var_concerned[id] = true;
+    
+    vector<bool>::reverse_iterator op_relevant_rev_it = op_relevant.rbegin();
+    chunkedVector<size_t>::const_reverse_iterator op_trace_rev_it = op_trace.rbegin();
+    chunkedVector<size_t>::const_reverse_iterator index_trace_rev_it = index_trace.rbegin();
+    
+    for (; op_trace_rev_it!= op_trace.rend(); ++op_trace_rev_it,++op_relevant_rev_it)
+    {
+        size_t res = *index_trace_rev_it++;
+        
+        //functions of several variables have to take
+        //into account all their arguments
+        size_t arity = op_arity(*op_trace_rev_it);
+        
+        if(var_concerned[res])
+        {
+            *op_relevant_rev_it = true;
+            visitor.result(res);
+            
+            for(size_t i = 0; i < arity; i++)
+            {
+                size_t arg = *index_trace_rev_it++;
+                var_concerned[arg] = true;
+                visitor.argument(arg);
+            }
+        }
+        else
+            index_trace_rev_it += arity;
+    }
+}
+
+void bdouble::run_tape(const size_t orderOverride)
+{
+    if(orderOverride == -1)
+        mOrder = mDefaultOrder;
+    else
+        mOrder = orderOverride;
+    
+    if(mOrder == 0)
+        throw;
+    
+    //initially I overestimate the number of free slots
+    //I will need for my calculation at the number
+    //of variables used.
+    deque<size_t> free_slots(indexcount);
+    for(size_t i=0;i<indexcount;i++)
+        free_slots[i] = i;
+    
+    vector<bool> op_relevant;
+    vector<bool>::reverse_iterator op_relevant_rev_it;
+    chunkedVector<size_t>::const_reverse_iterator op_trace_rev_it;
+    chunkedVector<size_t>::const_reverse_iterator index_trace_rev_it;
+    
+    vector<size_t> id_slot_map(indexcount,-1);
+    vector<size_t> slot_id_map(indexcount,-1);
+    
+    slotAllocator allocator(free_slots,id_slot_map,slot_id_map);
+    allocator.argument(mThisId);
+    
+    vector<bool> var_concerned;
+    relevant_ops(mThisId,op_relevant,var_concerned,allocator);
+    size_t max_nvar = allocator.max_nvar;
+    
+    size_t res,arg1,arg2;
+    
+    mLastMaxNvar = max_nvar;
+    
+    //we are now going to fill the free slots so that
+    //at the end of the run all the initial ids will
+    //fall ordered in the first mCoeff slots
+    free_slots.clear();
+    free_slots.resize(max_nvar);
+    
+    slot_id_map.erase (slot_id_map.begin()+max_nvar,slot_id_map.end());
+    
+    //here we fill the slots that correspond to initial variables
+    //starting from 0
+    size_t slot = 0;
+    for(vector<size_t>::const_iterator id_slot_map_it = id_slot_map.begin(); id_slot_map_it != id_slot_map.end(); id_slot_map_it++)
+    {
+        if(*id_slot_map_it != -1)
+        {
+            free_slots[*id_slot_map_it] = slot;
+            slot++;
+        }
+    }
+    
+    //here we fill the rest of the slots so that we have
+    //max_nvar slots from 0 to (max_nvar-1)
+    for(vector<size_t>::iterator slot_id_map_it = slot_id_map.begin(); slot_id_map_it != slot_id_map.end(); slot_id_map_it++)
+    {
+        if(*slot_id_map_it == -1)
+        {
+            free_slots[distance(slot_id_map.begin(),slot_id_map_it)] = slot;
+            slot++;
+        }
+    }
+    
+    slot_id_map.clear();
+    std::fill (id_slot_map.begin(),id_slot_map.end(),-1);
+    
+    //we don't go further if the coefficients can't be addressed
+    size_t bytes;
+    if(!coeff_memory(max_nvar,mOrder,bytes) || multisetcoeff(max_nvar+1,mOrder) > mCoeff.max_size())
+    {
+        std::ostringstream message;
+        message << "run_tape: " << max_nvar << " variables at order " << mOrder
+                << " need about " << coeff_memory_estimate(max_nvar,mOrder) << " bytes";
+        throw std::length_error(message.str());
+    }
+    
+    //a previous run of this bdouble may have left coefficients
+    mCoeff.assign(multisetcoeff(max_nvar+1,mOrder),0);
+    mCoeff[0] = mValue;
+    
+    vector<size_t> idxes;
+    idxes.clear();
+    idxes.resize(free_slots.size()+1,0);
+    idxes[0] = mOrder;
+    
+    mId.clear();
+    mId.resize(free_slots.size(),-1);
+    
+    id_slot_map[mThisId] = free_slots.front();
+    mId[free_slots.front()] = mThisId;
+    free_slots.pop_front();
+    idxes[0]--;
+    idxes[id_slot_map[mThisId]+1]++;
+    get(idxes) = 1.0;
+    idxes[0]++;
+    idxes[id_slot_map[mThisId]+1]--;
+    
+    op_relevant_rev_it = op_relevant.rbegin();
+    op_trace_rev_it = op_trace.rbegin();
+    index_trace_rev_it = index_trace.rbegin();
+    chunkedVector<double>::const_reverse_iterator val_trace_rev_it = val_trace.rbegin();
+    
+    vector<size_t> idxes_sparse;
+    
+    for (; op_trace_rev_it!= op_trace.rend(); ++op_trace_rev_it,++op_relevant_rev_it)
+        switch(*op_trace_rev_it)
+    {
+        case multconstv:
+        case sumconstv:
+        case minusconstv:
+        case cosv:
+        case sinv:
+        case expv:
+        case exp2v:
+        case expm1v:
+        case powv:
+        case powintv:
+        case powbasev:
+        case invv:
+        case logv:
+        case log1pv:
+        case log10v:
+        case log2v:
+        case coshv:
+        case sinhv:
+        case erfv:
+        case erfcv:
+        case nv:
+        case npdfv:
+        case tanv:
+        case tanhv:
+        case acosv:
+        case asinv:
+        case atanv:
+        case acoshv:
+        case asinhv:
+        case atanhv:
+        case lgammav:
+        case tgammav:
+        case fabsv:
+        case fmaxconstv:
+        case fminconstv:
+        case smoothabsv:
+            
+            if(*op_relevant_rev_it)
+            {
+                res = *index_trace_rev_it++;
+                size_t res_pos = id_slot_map[res];
+                
+                free_slots.push_front(res_pos);
+                mId[res_pos] = -1;
+                id_slot_map[res] = -1;
+                
+                arg1 = *index_trace_rev_it++;
+                
+                //second case works always, first case is faster
+                if (mOrder == 1)
+                {
+                    if(id_slot_map[arg1] == -1)
+                    {
+                        id_slot_map[arg1] = free_slots.front();
+                        mId[free_slots.front()] = arg1;
+                        free_slots.pop_front();
                     }
+                    size_t arg_pos = id_slot_map[arg1];
+                    
+                    double temp = mCoeff[res_pos+1];
+                    mCoeff[res_pos+1] = 0;
+                    
+                    mCoeff[arg_pos+1] += temp*der_unary(*op_trace_rev_it,val_trace_rev_it);
                 }
                 else
                 {
@@ -1397,131 +2150,151 @@ void bdouble::run_tape(const size_t orderOverride)
                     }
                     size_t arg_pos = id_slot_map[arg1];
                     
-                    vector<double> taylorexp(mOrder+1);
+                    vector<kdouble> taylorexp(mOrder+1);
                     taylorexp[0] = *val_trace_rev_it++;
                     
                     switch(*op_trace_rev_it)
                     {
                         case multconstv:
                         {
-                            double coeff = *val_trace_rev_it++;
-                            TE_multconst(0,coeff,taylorexp,1);
+                            kdouble coeff = *val_trace_rev_it++;
+                            TE_multconst<kdouble>(0,coeff,taylorexp,1);
                             break;
                         }
                         case sumconstv:
                         {
-                            TE_sumconst(0,0,taylorexp,1);
+                            TE_sumconst<kdouble>(0,0,taylorexp,1);
                             break;
                         }
                         case minusconstv:
                         {
-                            TE_minusconst(0,0,taylorexp,1);
+                            TE_minusconst<kdouble>(0,0,taylorexp,1);
                             break;
                         }
                         case cosv:
-                            TE_cos(*val_trace_rev_it++,taylorexp,1);
+                            TE_cos<kdouble>(*val_trace_rev_it++,taylorexp,1);
                             break;
                         case sinv:
-                            TE_sin(*val_trace_rev_it++,taylorexp,1);
+                            TE_sin<kdouble>(*val_trace_rev_it++,taylorexp,1);
                             break;
                         case expv:
-                            TE_exp(0,taylorexp,1);
+                            TE_exp<kdouble>(0,taylorexp,1);
                             break;
                         case exp2v:
-                            TE_exp2(0,taylorexp,1);
+                            TE_exp2<kdouble>(0,taylorexp,1);
                             break;
                         case expm1v:
-                            TE_expm1(*val_trace_rev_it++,taylorexp,1);
+                            TE_expm1<kdouble>(*val_trace_rev_it++,taylorexp,1);
                             break;
                         case powv:
                         {
-                            double deg = *val_trace_rev_it++;
-                            TE_pow(*val_trace_rev_it++,deg,taylorexp,1);
+                            kdouble deg = *val_trace_rev_it++;
+                            TE_pow<kdouble>(*val_trace_rev_it++,deg,taylorexp,1);
                             break;
                         }
                         case powintv:
                         {
-                            double deg = *val_trace_rev_it++;
-                            TE_powint(*val_trace_rev_it++,deg,taylorexp,1);
+                            kdouble deg = *val_trace_rev_it++;
+                            TE_powint<kdouble>(*val_trace_rev_it++,deg,taylorexp,1);
+                            break;
+                        }
+                        case powbasev:
+                        {
+                            kdouble base = *val_trace_rev_it++;
+                            TE_powbase<kdouble>(*val_trace_rev_it++,base,taylorexp,1);
                             break;
                         }
                         case invv:
-                            TE_inv(0,taylorexp,1);
+                            TE_inv<kdouble>(0,taylorexp,1);
                             break;
                         case logv:
-                            TE_log(*val_trace_rev_it++,taylorexp,1);
+                            TE_log<kdouble>(*val_trace_rev_it++,taylorexp,1);
                             break;
                         case log1pv:
-                            TE_log1p(*val_trace_rev_it++,taylorexp,1);
+                            TE_log1p<kdouble>(*val_trace_rev_it++,taylorexp,1);
                             break;
                         case log10v:
-                            TE_log10(*val_trace_rev_it++,taylorexp,1);
+                            TE_log10<kdouble>(*val_trace_rev_it++,taylorexp,1);
                             break;
                         case log2v:
-                            TE_log2(*val_trace_rev_it++,taylorexp,1);
+                            TE_log2<kdouble>(*val_trace_rev_it++,taylorexp,1);
                             break;
                         case coshv:
-                            TE_cosh(*val_trace_rev_it++,taylorexp,1);
+                            TE_cosh<kdouble>(*val_trace_rev_it++,taylorexp,1);
                             break;
                         case sinhv:
-                            TE_sinh(*val_trace_rev_it++,taylorexp,1);
+                            TE_sinh<kdouble>(*val_trace_rev_it++,taylorexp,1);
                             break;
                         case erfv:
-                            TE_erf(*val_trace_rev_it++,taylorexp,1);
+                            TE_erf<kdouble>(*val_trace_rev_it++,taylorexp,1);
                             break;
                         case erfcv:
-                            TE_erfc(*val_trace_rev_it++,taylorexp,1);
+                            TE_erfc<kdouble>(*val_trace_rev_it++,taylorexp,1);
                             break;
                         case nv:
-                            TE_N(*val_trace_rev_it++,taylorexp,1);
+                            TE_N<kdouble>(*val_trace_rev_it++,taylorexp,1);
+                            break;
+                        case npdfv:
+                            TE_npdf<kdouble>(*val_trace_rev_it++,taylorexp,1);
                             break;
                         case tanv:
-                            TE_tan(0,taylorexp,1);
+                            TE_tan<kdouble>(0,taylorexp,1);
                             break;
                         case tanhv:
-                            TE_tanh(0,taylorexp,1);
+                            TE_tanh<kdouble>(0,taylorexp,1);
                             break;
                         case acosv:
-                            TE_acos(*val_trace_rev_it++,taylorexp,1);
+                            TE_acos<kdouble>(*val_trace_rev_it++,taylorexp,1);
                             break;
                         case asinv:
-                            TE_asin(*val_trace_rev_it++,taylorexp,1);
+                            TE_asin<kdouble>(*val_trace_rev_it++,taylorexp,1);
                             break;
                         case atanv:
-                            TE_atan(*val_trace_rev_it++,taylorexp,1);
+                            TE_atan<kdouble>(*val_trace_rev_it++,taylorexp,1);
                             break;
                         case acoshv:
-                            TE_acosh(*val_trace_rev_it++,taylorexp,1);
+                            TE_acosh<kdouble>(*val_trace_rev_it++,taylorexp,1);
                             break;
                         case asinhv:
-                            TE_asinh(*val_trace_rev_it++,taylorexp,1);
+                            TE_asinh<kdouble>(*val_trace_rev_it++,taylorexp,1);
                             break;
                         case atanhv:
-                            TE_atanh(*val_trace_rev_it++,taylorexp,1);
+                            TE_atanh<kdouble>(*val_trace_rev_it++,taylorexp,1);
                             break;
                         case lgammav:
-                            TE_lgamma(*val_trace_rev_it++,taylorexp,1);
+                            TE_lgamma<kdouble>(*val_trace_rev_it++,taylorexp,1);
                             break;
                         case tgammav:
-                            TE_tgamma(*val_trace_rev_it++,taylorexp,1);
+                            TE_tgamma<kdouble>(*val_trace_rev_it++,taylorexp,1);
                             break;
+                        case fabsv:
+                            TE_fabs<kdouble>(*val_trace_rev_it++,taylorexp,1);
+                            break;
+                        case fmaxconstv:
+                        {
+                            kdouble bound = *val_trace_rev_it++;
+                            TE_fmaxconst<kdouble>(*val_trace_rev_it++,bound,taylorexp,1);
+                            break;
+                        }
+                        case fminconstv:
+                        {
+                            kdouble bound = *val_trace_rev_it++;
+                            TE_fminconst<kdouble>(*val_trace_rev_it++,bound,taylorexp,1);
+                            break;
+                        }
+                        case smoothabsv:
+                        {
+                            kdouble eps = *val_trace_rev_it++;
+                            TE_smoothabs<kdouble>(*val_trace_rev_it++,eps,taylorexp,1);
+                            break;
+                        }
                     }
                     
-                    vector<vector<double> > der_mult_cache(mOrder);
+                    vector<vector<kdouble> > der_mult_cache(mOrder);
                     for(size_t i = 1; i <= der_mult_cache.size(); i++)
                     {
                         der_mult_cache[i-1].resize(i,0);
-                        
-                        vector<size_t> part;
-                        partitionGenerator pg(i);
-                        while(pg.next(part))
-                        {
-                            double temp = pg.multiplicity(part);
-                            for(size_t j = 0; j < part.size(); j++)
-                                temp *= taylorexp[part[j]];
-                            
-                            der_mult_cache[i-1][part.size()-1] += temp;
-                        }
+                        TE_partitions(i,taylorexp,&der_mult_cache[i-1][0]);
                     }
                     
                     idxes_sparse.clear();
@@ -1530,6 +2303,14 @@ void bdouble::run_tape(const size_t orderOverride)
                     idxes.clear();
                     idxes.resize(mId.size()+1,0);
                     
+                    //the coefficients we touch only differ from the
+                    //current multiset on arg and res
+                    vector<size_t> ranker_positions;
+                    ranker_positions.push_back(arg_pos+1);
+                    ranker_positions.push_back(res_pos+1);
+                    multisetRanker ranker(idxes.size(),mOrder,ranker_positions);
+                    size_t moved[2];
+                    
                     //we need to keep at least one derivative for res
                     //hence the -1
                     multisetGenerator mg(idxes_sparse.size(),mOrder - 1);
@@ -1539,40 +2320,37 @@ void bdouble::run_tape(const size_t orderOverride)
                         for(size_t i = 0; i < sparse_to_dense.size(); i++)
                             idxes[sparse_to_dense[i]+1] = idxes_sparse[i+1];
                         
+                        ranker.set(idxes);
+                        
                         size_t order = 1+idxes_sparse[0];
                         
                         if(!arg1_alive)
                         {
+                            //because we know that arg1 wasn't included
+                            //res_pos is the same as arg_pos
+                            moved[0] = 0;
+                            
                             //we cache the derivs values first as we
                             //want to avoid calling them multiple times
-                            vector<double> derivstemp(order);
+                            vector<kdouble> derivstemp(order);
                             for(size_t i = 0; i<order; i++)
                             {
-                                idxes[0] = order - (i+1);
-                                idxes[res_pos+1] = (i+1);
-                                derivstemp[i] = get(idxes);
+                                moved[1] = i+1;
+                                derivstemp[i] = mCoeff[ranker.rank(moved)];
                             }
                             
-                            //reset it again
-                            order = 1+idxes_sparse[0];
-                            idxes[0] = 0;
-                            
                             //we need to go from higher to lower order here
                             //as the high order derivatives can be overriden
                             //before the lower order derivatives
                             while(order > 0)
                             {
-                                double temp = 0;
+                                kdouble temp = 0;
                                 for (size_t i = 0; i<order; i++)
                                     temp += derivstemp[i] * der_mult_cache[order-1][i];
                                 
-                                //because we know that arg1 wasn't included
-                                //res_pos is the same as arg_pos
-                                idxes[res_pos+1] = order;
-                                get(idxes)= temp;
-                                idxes[res_pos+1] = 0;
+                                moved[1] = order;
+                                mCoeff[ranker.rank(moved)] = temp;
                                 
-                                idxes[0]++;
                                 order--;
                             }
                         }
@@ -1582,23 +2360,19 @@ void bdouble::run_tape(const size_t orderOverride)
                             //want to avoid calling them multiple times.
                             //in this case we cache all partial derivs
                             //in res and arg
-                            vector<vector<double> > derivstemp(order);
+                            vector<vector<kdouble> > derivstemp(order);
                             for(size_t i = 1; i <= derivstemp.size(); i++)
                             {
                                 derivstemp[i-1].resize(i,0);
-                                idxes[arg_pos+1] = order - i;
+                                moved[0] = order - i;
                                 
                                 for (size_t j = 1; j<=i; j++)
                                 {
-                                    idxes[res_pos+1] = j;
-                                    idxes[0] = i - j;
-                                    derivstemp[i-1][j-1] = get(idxes);
+                                    moved[1] = j;
+                                    derivstemp[i-1][j-1] = mCoeff[ranker.rank(moved)];
                                 }
                             }
                             
-                            //reset it again
-                            order = 1+idxes_sparse[0];
-                            idxes[0] = 0;
                             size_t offset = 0;
                             
                             //we need to go from higher to lower order here
@@ -1606,11 +2380,11 @@ void bdouble::run_tape(const size_t orderOverride)
                             //before the lower order derivatives
                             while(order > 0)
                             {
-                                double temp = 0;
+                                kdouble temp = 0;
                                 
                                 for (size_t i = 0; i<order; i++)
                                 {
-                                    double temp2 = 0;
+                                    kdouble temp2 = 0;
                                     for (size_t j = 0; j<der_mult_cache[i].size(); j++)
                                         temp2 += derivstemp[i+offset][j] * der_mult_cache[i][j];
                                     
@@ -1621,18 +2395,16 @@ void bdouble::run_tape(const size_t orderOverride)
                                 //we reset partial derivs that are now 0
                                 for (size_t i = 0; i<order; i++)
                                 {
-                                    idxes[res_pos+1] = order - i;
-                                    idxes[arg_pos+1] = i;
-                                    get(idxes) = 0;
+                                    moved[0] = i;
+                                    moved[1] = order - i;
+                                    mCoeff[ranker.rank(moved)] = 0;
                                 }
                                 
                                 //then we add up the new derivative
-                                idxes[res_pos+1] = 0;
-                                idxes[arg_pos+1] = order;
-                                get(idxes) += temp;
-                                idxes[arg_pos+1] = 0;
+                                moved[0] = order;
+                                moved[1] = 0;
+                                mCoeff[ranker.rank(moved)] += temp;
                                 
-                                idxes[0]++;
                                 order--;
                                 offset++;
                             }
@@ -1643,24 +2415,7 @@ void bdouble::run_tape(const size_t orderOverride)
             else
             {
                 index_trace_rev_it += 2;
-                switch(*op_trace_rev_it)
-                {
-                    case sumconstv:
-                    case minusconstv:
-                    case expv:
-                    case exp2v:
-                    case invv:
-                    case tanv:
-                    case tanhv:
-                        val_trace_rev_it += 1;
-                        break;
-                    case powv:
-                    case powintv:
-                        val_trace_rev_it += 3;
-                        break;
-                    default:
-                        val_trace_rev_it += 2;
-                }
+                val_trace_rev_it += op_vals(*op_trace_rev_it);
             }
             
             break;
@@ -1738,6 +2493,15 @@ void bdouble::run_tape(const size_t orderOverride)
                     idxes.clear();
                     idxes.resize(mId.size()+1,0);
                     
+                    //the coefficients we touch only differ from the
+                    //current multiset on arg1, arg2 and res
+                    vector<size_t> ranker_positions;
+                    ranker_positions.push_back(arg1_pos+1);
+                    ranker_positions.push_back(arg2_pos+1);
+                    ranker_positions.push_back(res_pos+1);
+                    multisetRanker ranker(idxes.size(),mOrder,ranker_positions);
+                    size_t moved[3];
+                    
                     //we need to keep at least one derivative for res
                     //hence the -1
                     multisetGenerator mg(idxes_sparse.size(),mOrder - 1);
@@ -1747,32 +2511,34 @@ void bdouble::run_tape(const size_t orderOverride)
                         for(size_t i = 0; i < sparse_to_dense.size(); i++)
                             idxes[sparse_to_dense[i]+1] = idxes_sparse[i+1];
                         
+                        ranker.set(idxes);
+                        
                         size_t order = 1+idxes_sparse[0];
-                        idxes[0] = 0;
                         
                         //we need to go from higher to lower order here
                         //as the high order derivatives can be overriden
                         //before the lower order derivatives
                         while(order > 0)
                         {
-                            idxes[res_pos+1] = order;
-                            vector<vector<double> > derivsarg1and2;
+                            vector<vector<kdouble> > derivsarg1and2;
                             derivsarg1and2.resize(order);
                             for(size_t i = 0; i < order; i++)
                             {
                                 bool icondition = (i==0) || arg1_alive;
                                 if(icondition)
                                 {
-                                    idxes[arg1_pos+1] = i;
+                                    moved[0] = i;
                                     derivsarg1and2[i].resize(order-i,0);
                                     for(size_t j = 0; j < (order-i); j++)
                                     {
                                         bool jcondition = (j==0) || arg2_alive;
                                         if(jcondition)
                                         {
-                                            idxes[arg2_pos+1] = j;
-                                            idxes[res_pos+1] = order - i - j;
-                                            std::swap(derivsarg1and2[i][j],get(idxes));
+                                            moved[1] = j;
+                                            moved[2] = order - i - j;
+                                            double& coeff = mCoeff[ranker.rank(moved)];
+                                            derivsarg1and2[i][j] = coeff;
+                                            coeff = 0;
                                         }
                                     }
                                 }
@@ -1781,17 +2547,17 @@ void bdouble::run_tape(const size_t orderOverride)
                             vector<size_t> idxarg1arg2;
                             multisetGenerator mg2(2,order);
                             
-                            idxes[res_pos+1]= 0;
+                            moved[2] = 0;
                             while(mg2.next(idxarg1arg2))
                             {
-                                double temp = 0;
+                                kdouble temp = 0;
                                 
                                 for(size_t i = 0; i <= idxarg1arg2[0]; i++)
                                 {
                                     bool icondition = (i==0) || arg1_alive;
                                     if(icondition)
                                     {
-                                        double temp2 = combins(i,idxarg1arg2[0],true);
+                                        kdouble temp2 = combins(i,idxarg1arg2[0],true);
                                         for(size_t j = 0; j <= idxarg1arg2[1]; j++)
                                         {
                                             bool notlast = (i != idxarg1arg2[0]) || (j != idxarg1arg2[1]);
@@ -1812,16 +2578,11 @@ void bdouble::run_tape(const size_t orderOverride)
                                     }
                                 }
                                 
-                                idxes[arg1_pos+1] = 0;
-                                idxes[arg2_pos+1] = 0;
-                                idxes[arg1_pos+1] += idxarg1arg2[0];
-                                idxes[arg2_pos+1] += idxarg1arg2[1];
-                                get(idxes) += temp;
+                                moved[0] = idxarg1arg2[0];
+                                moved[1] = idxarg1arg2[1];
+                                mCoeff[ranker.rank(moved)] += temp;
                             }
                             
-                            idxes[arg1_pos+1] = 0;
-                            idxes[arg2_pos+1] = 0;
-                            idxes[0]++;
                             order--;
                         }
                     }
@@ -1897,9 +2658,9 @@ void bdouble::run_tape(const size_t orderOverride)
                     size_t arg1_pos = id_slot_map[arg1];
                     size_t arg2_pos = id_slot_map[arg2];
                     
-                    double x1 = (*val_trace_rev_it++);
-                    double x2 = (*val_trace_rev_it++);
-                    vector<vector<double> > d_g_x1_x2;
+                    kdouble x1 = (*val_trace_rev_it++);
+                    kdouble x2 = (*val_trace_rev_it++);
+                    vector<vector<kdouble> > d_g_x1_x2;
                     
                     //create the triangle
                     d_g_x1_x2.resize(mOrder+1);
@@ -1925,6 +2686,15 @@ void bdouble::run_tape(const size_t orderOverride)
                     idxes.clear();
                     idxes.resize(mId.size()+1,0);
                     
+                    //the coefficients we touch only differ from the
+                    //current multiset on arg1, arg2 and res
+                    vector<size_t> ranker_positions;
+                    ranker_positions.push_back(arg1_pos+1);
+                    ranker_positions.push_back(arg2_pos+1);
+                    ranker_positions.push_back(res_pos+1);
+                    multisetRanker ranker(idxes.size(),mOrder,ranker_positions);
+                    size_t moved[3];
+                    
                     //we need to keep at least one derivative for res
                     //hence the -1
                     multisetGenerator mg(idxes_sparse.size(),mOrder - 1);
@@ -1934,31 +2704,33 @@ void bdouble::run_tape(const size_t orderOverride)
                         for(size_t i = 0; i < sparse_to_dense.size(); i++)
                             idxes[sparse_to_dense[i]+1] = idxes_sparse[i+1];
                         
+                        ranker.set(idxes);
+                        
                         size_t order = 1+idxes_sparse[0];
-                        idxes[0] = 0;
                         
-                        vector<vector<vector<double> > > d_f_x1_x2_y;
+                        vector<vector<vector<kdouble> > > d_f_x1_x2_y;
                         d_f_x1_x2_y.resize(order);
                         for(size_t i = 0; i < order; i++)
                         {
                             bool icondition = (i==0) || arg1_alive;
                             if(icondition)
                             {
-                                idxes[arg1_pos+1] = i;
+                                moved[0] = i;
                                 d_f_x1_x2_y[i].resize(order-i);
                                 for(size_t j = 0; j < (order-i); j++)
                                 {
                                     bool jcondition = (j==0) || arg2_alive;
                                     if(jcondition)
                                     {
-                                        idxes[arg2_pos+1] = j;
+                                        moved[1] = j;
                                         d_f_x1_x2_y[i][j].resize(order-i-j);
                                         for(size_t k = 0; k < (order-i-j); k++)
                                         {
-                                            idxes[res_pos+1] = k+1;
-                                            idxes[0] = order - i - j - (k+1);
+                                            moved[2] = k+1;
                                             
-                                            std::swap(d_f_x1_x2_y[i][j][k],get(idxes));
+                                            double& coeff = mCoeff[ranker.rank(moved)];
+                                            d_f_x1_x2_y[i][j][k] = coeff;
+                                            coeff = 0;
                                         }
                                     }
                                 }
@@ -1968,7 +2740,7 @@ void bdouble::run_tape(const size_t orderOverride)
                         //we need to go from higher to lower order here
                         //as the high order derivatives can be overriden
                         //before the lower order derivatives
-                        idxes[res_pos+1]= 0;
+                        moved[2] = 0;
                         while(order > 0)
                         {
                             vector<size_t> idxarg1arg2;
@@ -1976,19 +2748,24 @@ void bdouble::run_tape(const size_t orderOverride)
                             
                             while(mg2.next(idxarg1arg2))
                             {
-                                double temp = 0;
+                                kdouble temp = 0;
                                 
                                 size_t cross_ders = min(idxarg1arg2[0],idxarg1arg2[1]);
                                 
+                                //the k cross derivatives can be paired in k! ways
+                                kdouble pairings = 1;
                                 for(size_t k = 0; k <= cross_ders; k++)
                                 {
-                                    double temp3 = combins(k,idxarg1arg2[0],true) * combins(k,idxarg1arg2[1],true);
+                                    if(k)
+                                        pairings *= k;
+                                    
+                                    kdouble temp3 = combins(k,idxarg1arg2[0],true) * combins(k,idxarg1arg2[1],true) * pairings;
                                     for(size_t i = 0; i <= (idxarg1arg2[0]-k); i++)
                                     {
                                         bool icondition = (i==0) || arg1_alive;
                                         if(icondition)
                                         {
-                                            double temp2 = combins(i,idxarg1arg2[0]-k,true) * temp3;
+                                            kdouble temp2 = combins(i,idxarg1arg2[0]-k,true) * temp3;
                                             for(size_t j = 0; j <= (idxarg1arg2[1]-k); j++)
                                             {
                                                 bool notlast = (k!=0) || (i != idxarg1arg2[0]) || (j != idxarg1arg2[1]);
@@ -2000,16 +2777,11 @@ void bdouble::run_tape(const size_t orderOverride)
                                     }
                                 }
                                 
-                                idxes[arg1_pos+1] = 0;
-                                idxes[arg2_pos+1] = 0;
-                                idxes[arg1_pos+1] += idxarg1arg2[0];
-                                idxes[arg2_pos+1] += idxarg1arg2[1];
-                                get(idxes) += temp;
+                                moved[0] = idxarg1arg2[0];
+                                moved[1] = idxarg1arg2[1];
+                                mCoeff[ranker.rank(moved)] += temp;
                             }
                             
-                            idxes[arg1_pos+1] = 0;
-                            idxes[arg2_pos+1] = 0;
-                            idxes[0]++;
                             order--;
                         }
                     }
@@ -2022,55 +2794,1297 @@ void bdouble::run_tape(const size_t orderOverride)
             }
             
             break;
+        
+        case blackscholesv:
+        case lognpdfv:
+        case atan2v:
+        case hypotv:
+        case fmav:
+        case powbv:
+        case fmaxv:
+        case fminv:
+        case selectv:
+            
+            if(*op_relevant_rev_it)
+            {
+                size_t arity = op_arity(*op_trace_rev_it);
+                
+                res = *index_trace_rev_it++;
+                size_t res_pos = id_slot_map[res];
+                
+                free_slots.push_front(res_pos);
+                mId[res_pos] = -1;
+                id_slot_map[res] = -1;
+                
+                //we skip the result, arguments were
+                //recorded in order
+                val_trace_rev_it++;
+                vector<size_t> args(arity);
+                vector<double> values(arity);
+                for(size_t i = arity; i > 0; i--)
+                {
+                    args[i-1] = *index_trace_rev_it++;
+                    values[i-1] = *val_trace_rev_it++;
+                }
+                
+                //the same id can be passed several times, in
+                //which case we differentiate with respect to it once
+                vector<size_t> unique_args;
+                vector<size_t> arg_map(arity);
+                for(size_t i = 0; i < arity; i++)
+                {
+                    size_t j = find(unique_args.begin(), unique_args.end(), args[i]) - unique_args.begin();
+                    if(j == unique_args.size())
+                        unique_args.push_back(args[i]);
+                    
+                    arg_map[i] = j;
+                }
+                
+                size_t nargs = unique_args.size();
+                
+                taylorPolynomial g = TE_nary(*op_trace_rev_it,values,mOrder);
+                if(nargs != arity)
+                    g = g.substitute(arg_map,nargs);
+                
+                //second case works always, first case is faster
+                if (mOrder == 1)
+                {
+                    double temp = mCoeff[res_pos+1];
+                    mCoeff[res_pos+1] = 0;
+                    
+                    //slots are taken in the order of the first pass
+                    for(size_t i = arity; i > 0; i--)
+                    {
+                        if(id_slot_map[args[i-1]] == size_t(-1))
+                        {
+                            id_slot_map[args[i-1]] = free_slots.front();
+                            mId[free_slots.front()] = args[i-1];
+                            free_slots.pop_front();
+                        }
+                    }
+                    
+                    vector<size_t> powers(nargs,0);
+                    for(size_t i = 0; i < nargs; i++)
+                    {
+                        powers[i] = 1;
+                        mCoeff[id_slot_map[unique_args[i]]+1] += temp*g.der(powers);
+                        powers[i] = 0;
+                    }
+                }
+                else
+                {
+                    vector<bool> args_alive(nargs);
+                    for(size_t i = 0; i < nargs; i++)
+                        args_alive[i] = (id_slot_map[unique_args[i]] != size_t(-1));
+                    
+                    vector<size_t> sparse_to_dense;
+                    sparse_to_dense.reserve(mId.size()-free_slots.size());
+                    for(size_t i = 0; i < mId.size(); i++)
+                        if(mId[i] != size_t(-1) && find(unique_args.begin(), unique_args.end(), mId[i]) == unique_args.end())
+                            sparse_to_dense.push_back(i);
+                    
+                    //slots are taken in the order of the first pass
+                    for(size_t i = arity; i > 0; i--)
+                    {
+                        if(id_slot_map[args[i-1]] == size_t(-1))
+                        {
+                            id_slot_map[args[i-1]] = free_slots.front();
+                            mId[free_slots.front()] = args[i-1];
+                            free_slots.pop_front();
+                        }
+                    }
+                    
+                    vector<size_t> args_pos(nargs);
+                    for(size_t i = 0; i < nargs; i++)
+                        args_pos[i] = id_slot_map[unique_args[i]];
+                    
+                    vector<kdouble> factorials(mOrder+1,1);
+                    for(size_t i = 1; i <= mOrder; i++)
+                        factorials[i] = factorials[i-1]*i;
+                    
+                    //all the terms of a polynomial in the arguments
+                    vector<vector<size_t> > terms;
+                    vector<kdouble> terms_factorials;
+                    vector<size_t> term;
+                    multisetGenerator mg_terms(nargs+1,mOrder);
+                    while(mg_terms.next(term))
+                    {
+                        terms.push_back(term);
+                        
+                        kdouble factor = 1;
+                        for(size_t i = 1; i <= nargs; i++)
+                            factor *= factorials[term[i]];
+                        
+                        terms_factorials.push_back(factor);
+                    }
+                    
+                    //powers of (g - g(x)) and their non zero terms
+                    taylorPolynomial shift(g);
+                    shift.value() = 0;
+                    vector<taylorPolynomial> shift_powers(mOrder+1,taylorPolynomial(nargs,mOrder,1));
+                    vector<vector<size_t> > shift_terms(mOrder+1);
+                    for(size_t k = 0; k <= mOrder; k++)
+                    {
+                        if(k)
+                            shift_powers[k] = shift_powers[k-1]*shift;
+                        
+                        for(size_t i = 0; i < terms.size(); i++)
+                            if(shift_powers[k].coeffs()[i] != 0)
+                                shift_terms[k].push_back(i);
+                    }
+                    
+                    taylorPolynomial fg(nargs,mOrder);
+                    vector<size_t> idxes_f;
+                    vector<size_t> idxes_fg(nargs+1);
+                    
+                    idxes_sparse.clear();
+                    idxes_sparse.resize(sparse_to_dense.size()+1,0);
+                    
+                    idxes.clear();
+                    idxes.resize(mId.size()+1,0);
+                    
+                    //we need to keep at least one derivative for res
+                    //hence the -1
+                    multisetGenerator mg(idxes_sparse.size(),mOrder - 1);
+                    
+                    while(mg.next(idxes_sparse))
+                    {
+                        for(size_t i = 0; i < sparse_to_dense.size(); i++)
+                            idxes[sparse_to_dense[i]+1] = idxes_sparse[i+1];
+                        
+                        size_t order = 1+idxes_sparse[0];
+                        std::fill(fg.coeffs().begin(), fg.coeffs().end(), 0);
+                        
+                        //we take out every derivative of f with respect to
+                        //res (idxes_f[1]) and the arguments (idxes_f[i+2])
+                        //and add up its contribution to f(g)
+                        multisetGenerator mg_f(nargs+2,order);
+                        while(mg_f.next(idxes_f))
+                        {
+                            bool alive_condition = true;
+                            for(size_t i = 0; i < nargs; i++)
+                                alive_condition = alive_condition && (args_alive[i] || idxes_f[i+2] == 0);
+                            
+                            if(!alive_condition)
+                                continue;
+                            
+                            idxes[0] = idxes_f[0];
+                            idxes[res_pos+1] = idxes_f[1];
+                            kdouble factor = factorials[idxes_f[1]];
+                            size_t args_order = 0;
+                            for(size_t i = 0; i < nargs; i++)
+                            {
+                                if(args_alive[i])
+                                    idxes[args_pos[i]+1] = idxes_f[i+2];
+                                
+                                factor *= factorials[idxes_f[i+2]];
+                                args_order += idxes_f[i+2];
+                            }
+                            
+                            double& coeff = get(idxes);
+                            kdouble f_coeff = coeff/factor;
+                            coeff = 0;
+                            
+                            idxes[res_pos+1] = 0;
+                            for(size_t i = 0; i < nargs; i++)
+                                if(args_alive[i])
+                                    idxes[args_pos[i]+1] = 0;
+                            
+                            if(f_coeff == 0)
+                                continue;
+                            
+                            const vector<size_t>& k_terms = shift_terms[idxes_f[1]];
+                            for(size_t i = 0; i < k_terms.size(); i++)
+                            {
+                                const vector<size_t>& g_term = terms[k_terms[i]];
+                                size_t term_order = mOrder - g_term[0] + args_order;
+                                if(term_order <= order)
+                                {
+                                    idxes_fg[0] = mOrder - term_order;
+                                    for(size_t j = 1; j <= nargs; j++)
+                                        idxes_fg[j] = g_term[j] + idxes_f[j+1];
+                                    
+                                    fg.coeffs()[multisetcount(idxes_fg,mOrder)] += f_coeff*shift_powers[idxes_f[1]].coeffs()[k_terms[i]];
+                                }
+                            }
+                        }
+                        
+                        //then we put back the derivatives of f(g)
+                        for(size_t i = 0; i < terms.size(); i++)
+                        {
+                            size_t term_order = mOrder - terms[i][0];
+                            if(term_order <= order && fg.coeffs()[i] != 0)
+                            {
+                                idxes[0] = order - term_order;
+                                for(size_t j = 0; j < nargs; j++)
+                                    idxes[args_pos[j]+1] = terms[i][j+1];
+                                
+                                get(idxes) += fg.coeffs()[i]*terms_factorials[i];
+                                
+                                for(size_t j = 0; j < nargs; j++)
+                                    idxes[args_pos[j]+1] = 0;
+                            }
+                        }
+                    }
+                }
+            }
+            else
+            {
+                size_t arity = op_arity(*op_trace_rev_it);
+                index_trace_rev_it += arity+1;
+                val_trace_rev_it += arity+1;
+            }
+            
+            break;
+    }
+    
+    vector<size_t>::const_iterator cutoff = mId.begin();
+    
+    while(cutoff != mId.end() && *cutoff != -1)
+        cutoff++;
+    
+    //we need to clean up data from mId and mCoeff
+    if(cutoff != mId.end())
+    {
+        if(mOrder != 1)
+        {
+            idxes.clear();
+            idxes.resize(mId.size()+1,0);
+            multisetGenerator mg(idxes.size(),mOrder);
+            
+            vector<double>::iterator coarse = mCoeff.begin();
+            vector<double>::iterator fine   = mCoeff.begin();
+            
+            vector<size_t>::const_iterator id_it;
+            vector<size_t>::const_iterator id_it_begin = idxes.begin() + 1 + (cutoff - mId.begin());
+            while(mg.next(idxes))
+            {
+                id_it = id_it_begin;
+                
+                while(id_it != idxes.end() && *id_it == 0)
+                    id_it++;
+                
+                if(id_it == idxes.end())
+                {
+                    if(coarse != fine)
+                        swap(*coarse,*fine);
+                    
+                    coarse++;
+                }
+                
+                fine++;
+            }
+        }
+        
+        mId.erase(cutoff,mId.end());
+        mCoeff.resize(multisetcoeff(mId.size()+1,mOrder));
+    }
+}
+
+void bdouble::clear_tape()
+{
+    op_trace.clear();
+    index_trace.clear();
+    val_trace.clear();
+    indexcount = 0;
+    mFoldFloor = 0;
+    mTapeGeneration++;
+    unmap_tape_file();
+}
+
+void bdouble::release_tape()
+{
+    op_trace.release();
+    index_trace.release();
+    val_trace.release();
+    indexcount = 0;
+    mFoldFloor = 0;
+    mTapeGeneration++;
+    unmap_tape_file();
+}
+
+//saved tapes start with this header, followed by the saved
+//variables as (id, value) pairs and by the op, index and value
+//traces as they are. everything is 8 bytes aligned so that
+//the traces can be read in place from a mapped file.
+struct tapeFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t word_size;
+    uint64_t indexcount;
+    uint64_t ops;
+    uint64_t indices;
+    uint64_t values;
+    uint64_t nvars;
+};
+
+const char tape_file_magic[8] = {'A','D','H','O','C','T','A','P'};
+const uint32_t tape_file_version = 1;
+const uint32_t tape_file_byte_order = 0x01020304;
+
+void bdouble::save_tape(const string& path,const vector<bdouble>& vars)
+{
+    tapeFileHeader header;
+    memcpy(header.magic, tape_file_magic, sizeof(header.magic));
+    header.version = tape_file_version;
+    header.byte_order = tape_file_byte_order;
+    header.word_size = sizeof(size_t);
+    header.indexcount = indexcount;
+    header.ops = op_trace.size();
+    header.indices = index_trace.size();
+    header.values = val_trace.size();
+    header.nvars = vars.size();
+    
+    ofstream out(path.c_str(), ios::binary);
+    if(!out)
+        throw std::runtime_error("save_tape: can't open " + path);
+    
+    out.write((const char*)&header, sizeof(header));
+    for(size_t i = 0; i < vars.size(); i++)
+    {
+        uint64_t id = vars[i].mThisId;
+        out.write((const char*)&id, sizeof(id));
+        out.write((const char*)&vars[i].mValue, sizeof(double));
+    }
+    
+    op_trace.write(out);
+    index_trace.write(out);
+    val_trace.write(out);
+    
+    out.close();
+    if(!out)
+        throw std::runtime_error("save_tape: can't write " + path);
+}
+
+//the part of the file left after count elements of size bytes,
+//false if they don't fit
+bool take_from_file(uint64_t& left,const uint64_t& count,const size_t& size)
+{
+    if(count > left/size)
+        return false;
+    
+    left -= count*size;
+    return true;
+}
+
+vector<bdouble> bdouble::load_tape(const string& path,const bool& map)
+{
+    //a tape recorded in files can't read another file in place
+    if(map && op_trace.mapped())
+        release_tape();
+    else
+        clear_tape();
+    
+    ifstream in(path.c_str(), ios::binary);
+    if(!in)
+        throw std::runtime_error("load_tape: can't open " + path);
+    
+    in.seekg(0, ios::end);
+    uint64_t file_bytes = uint64_t(in.tellg());
+    in.seekg(0, ios::beg);
+    
+    tapeFileHeader header;
+    if(!in.read((char*)&header, sizeof(header)))
+        throw std::runtime_error("load_tape: " + path + " is too short for a tape file");
+    
+    if(memcmp(header.magic, tape_file_magic, sizeof(header.magic)) != 0)
+        throw std::runtime_error("load_tape: " + path + " is not a tape file");
+    if(header.version > tape_file_version)
+        throw std::runtime_error("load_tape: " + path + " has a newer version");
+    if(header.byte_order != tape_file_byte_order || header.word_size != sizeof(size_t))
+        throw std::runtime_error("load_tape: " + path + " was saved on another architecture");
+    
+    //the sizes have to match the file before anything is allocated
+    uint64_t left = file_bytes - sizeof(header);
+    if(!take_from_file(left, header.nvars, sizeof(uint64_t) + sizeof(double))
+       || !take_from_file(left, header.ops, sizeof(size_t))
+       || !take_from_file(left, header.indices, sizeof(size_t))
+       || !take_from_file(left, header.values, sizeof(double))
+       || left != 0)
+        throw std::runtime_error("load_tape: the sizes in " + path + " don't match its length");
+    
+    //ids are set by hand, the constructor would take new ones
+    vector<bdouble> vars(header.nvars);
+    for(size_t i = 0; i < vars.size(); i++)
+    {
+        uint64_t id;
+        if(!in.read((char*)&id, sizeof(id)) || !in.read((char*)&vars[i].mValue, sizeof(double)))
+            throw std::runtime_error("load_tape: can't read " + path);
+        if(id >= header.indexcount)
+            throw std::runtime_error("load_tape: " + path + " has a variable out of range");
+        vars[i].mThisId = id;
+    }
+    
+    if(map)
+    {
+#ifdef ADHOC_TAPE_MMAP
+        size_t offset = sizeof(header) + header.nvars*(sizeof(uint64_t) + sizeof(double));
+        size_t bytes = file_bytes;
+        
+        int fd = open(path.c_str(), O_RDONLY);
+        if(fd == -1)
+            throw std::system_error(errno, std::generic_category(), "load_tape: open " + path);
+        void* file = mmap(0, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+        int mmap_errno = errno;
+        close(fd);
+        if(file == MAP_FAILED)
+            throw std::system_error(mmap_errno, std::generic_category(), "load_tape: mmap " + path);
+        
+        mTapeFile = file;
+        mTapeFileBytes = bytes;
+        
+        const char* pos = (const char*)file + offset;
+        op_trace.adopt((const size_t*)pos, header.ops);
+        pos += header.ops*sizeof(size_t);
+        index_trace.adopt((const size_t*)pos, header.indices);
+        pos += header.indices*sizeof(size_t);
+        val_trace.adopt((const double*)pos, header.values);
+#else
+        throw std::runtime_error("load_tape: mapped tapes are not supported on this platform");
+#endif
+    }
+    else
+    {
+        try
+        {
+            op_trace.read(in, header.ops);
+            index_trace.read(in, header.indices);
+            val_trace.read(in, header.values);
+        }
+        catch(...)
+        {
+            clear_tape();
+            throw;
+        }
+    }
+    
+    //every op has to be known and its ids in range, otherwise
+    //run_tape would go out of bounds
+    size_t indices = 0;
+    size_t values = 0;
+    bool valid = true;
+    chunkedVector<size_t>::const_iterator index_trace_it = index_trace.begin();
+    for(chunkedVector<size_t>::const_iterator op_trace_it = op_trace.begin(); valid && op_trace_it != op_trace.end(); ++op_trace_it)
+    {
+        if(*op_trace_it >= opcount)
+        {
+            valid = false;
+            break;
+        }
+        
+        size_t count = op_arity(*op_trace_it) + 1;
+        indices += count;
+        values += op_vals(*op_trace_it);
+        if(indices > header.indices)
+        {
+            valid = false;
+            break;
+        }
+        
+        for(size_t i = 0; i < count; i++)
+            if(*index_trace_it++ >= header.indexcount)
+                valid = false;
+    }
+    
+    if(!valid || indices != header.indices || values != header.values)
+    {
+        clear_tape();
+        throw std::runtime_error("load_tape: the tape in " + path + " is corrupt");
+    }
+    
+    indexcount = header.indexcount;
+    return vars;
+}
+
+void bdouble::unmap_tape_file()
+{
+#ifdef ADHOC_TAPE_MMAP
+    if(mTapeFile != 0)
+        munmap(mTapeFile, mTapeFileBytes);
+#endif
+    mTapeFile = 0;
+    mTapeFileBytes = 0;
+}
+
+tapePosition bdouble::tape_position()
+{
+    tapePosition position;
+    position.ops = op_trace.size();
+    position.indices = index_trace.size();
+    position.values = val_trace.size();
+    position.ids = indexcount;
+    position.generation = mTapeGeneration;
+    
+    //the ops recorded so far may be referred to from the position
+    mFoldFloor = op_trace.size();
+    
+    return position;
+}
+
+void bdouble::rewind_tape(const tapePosition& position)
+{
+    if(position.generation != mTapeGeneration)
+        throw std::invalid_argument("rewind_tape: position from another tape");
+    if(position.ops > op_trace.size() || position.indices > index_trace.size() || position.values > val_trace.size() || position.ids > indexcount)
+        throw std::invalid_argument("rewind_tape: position past the end of the tape");
+    
+    op_trace.truncate(position.ops);
+    index_trace.truncate(position.indices);
+    val_trace.truncate(position.values);
+    indexcount = position.ids;
+    mFoldFloor = min(mFoldFloor, position.ops);
+}
+
+//an op as compared by optimize_tape: opcode, arguments and the
+//bit patterns of its values, the entries not used are 0
+struct tapeOpKey
+{
+    size_t op;
+    size_t args[4];
+    uint64_t vals[5];
+    
+    bool operator==(const tapeOpKey& rhs) const {return memcmp(this, &rhs, sizeof(tapeOpKey)) == 0;}
+};
+
+struct tapeOpKeyHash
+{
+    size_t operator()(const tapeOpKey& key) const
+    {
+        uint64_t words[10];
+        memcpy(words, &key, min(sizeof(words), sizeof(key)));
+        
+        uint64_t h = 14695981039346656037ULL;
+        for(size_t i = 0; i < sizeof(key)/sizeof(uint64_t); i++)
+            h = (h ^ words[i])*1099511628211ULL;
+        
+        return size_t(h ^ (h >> 32));
+    }
+};
+
+//the form optimize_tape gives to an op: arguments go through
+//alias and an affine op is taken on the source of its chain,
+//which is recorded for res
+void fold_op(size_t& op,vector<size_t>& args,vector<double>& vals,const size_t& res,const vector<size_t>& alias,vector<size_t>& linear_src,vector<double>& linear_factor)
+{
+    for(size_t i = 0; i < args.size(); i++)
+        if(alias[args[i]] != size_t(-1))
+            args[i] = alias[args[i]];
+    
+    if(op != sumconstv && op != minusconstv && op != multconstv)
+        return;
+    
+    size_t arg = args[0];
+    double factor = op == sumconstv ? 1 : (op == minusconstv ? -1 : vals[0]);
+    double result = vals.back();
+    
+    if(linear_src[arg] != size_t(-1))
+    {
+        factor *= linear_factor[arg];
+        arg = linear_src[arg];
+    }
+    linear_src[res] = arg;
+    linear_factor[res] = factor;
+    
+    //these ops only need their derivative and result
+    args[0] = arg;
+    vals.clear();
+    if(factor == 1)
+        op = sumconstv;
+    else if(factor == -1)
+        op = minusconstv;
+    else
+    {
+        op = multconstv;
+        vals.push_back(factor);
+    }
+    vals.push_back(result);
+}
+
+//same op on the same arguments and constants, the values
+//of an op are a function of those
+tapeOpKey op_key(const size_t& op,const vector<size_t>& args,const vector<double>& vals)
+{
+    tapeOpKey key;
+    memset(&key, 0, sizeof(key));
+    
+    key.op = op;
+    for(size_t i = 0; i < args.size(); i++)
+        key.args[i] = args[i];
+    for(size_t i = 0; i < vals.size(); i++)
+        memcpy(&key.vals[i], &vals[i], sizeof(uint64_t));
+    
+    if((op == bplusv || op == bmultv) && args[0] > args[1])
+    {
+        std::swap(key.args[0], key.args[1]);
+        if(op == bmultv)
+            std::swap(key.vals[0], key.vals[1]);
     }
     
-    vector<size_t>::const_iterator cutoff = mId.begin();
+    return key;
+}
+
+void bdouble::optimize_tape(vector<bdouble>& vars)
+{
+    //ids computed by an affine op: source id and factor
+    vector<size_t> linear_src(indexcount,-1);
+    vector<double> linear_factor(indexcount,1);
     
-    while(cutoff != mId.end() && *cutoff != -1)
-        cutoff++;
+    //ids computed by an op already on the tape
+    vector<size_t> alias(indexcount,-1);
     
-    //we need to clean up data from mId and mCoeff
-    if(cutoff != mId.end())
+    vector<size_t> args;
+    vector<double> vals;
+    
+    //first pass, chains are folded and repeated ops merged
     {
-        if(mOrder != 1)
+        unordered_map<tapeOpKey,size_t,tapeOpKeyHash> computed;
+        
+        chunkedVector<size_t>::const_iterator index_trace_it = index_trace.begin();
+        chunkedVector<double>::const_iterator val_trace_it = val_trace.begin();
+        for(chunkedVector<size_t>::const_iterator op_trace_it = op_trace.begin(); op_trace_it != op_trace.end(); ++op_trace_it)
         {
-            idxes.clear();
-            idxes.resize(mId.size()+1,0);
-            multisetGenerator mg(idxes.size(),mOrder);
+            size_t op = *op_trace_it;
             
-            vector<double>::iterator coarse = mCoeff.begin();
-            vector<double>::iterator fine   = mCoeff.begin();
+            args.resize(op_arity(op));
+            for(size_t i = 0; i < args.size(); i++)
+                args[i] = *index_trace_it++;
+            size_t res = *index_trace_it++;
             
-            vector<size_t>::const_iterator id_it;
-            vector<size_t>::const_iterator id_it_begin = idxes.begin() + 1 + (cutoff - mId.begin());
-            while(mg.next(idxes))
-            {
-                id_it = id_it_begin;
+            vals.resize(op_vals(op));
+            for(size_t i = 0; i < vals.size(); i++)
+                vals[i] = *val_trace_it++;
+            
+            fold_op(op,args,vals,res,alias,linear_src,linear_factor);
+            
+            pair<unordered_map<tapeOpKey,size_t,tapeOpKeyHash>::iterator,bool> inserted = computed.insert(make_pair(op_key(op,args,vals),res));
+            if(!inserted.second)
+                alias[res] = inserted.first->second;
+        }
+    }
+    
+    for(size_t i = 0; i < vars.size(); i++)
+        if(alias[vars[i].mThisId] != size_t(-1))
+            vars[i].mThisId = alias[vars[i].mThisId];
+    
+    //liveness from vars, merged ops are dropped
+    vector<bool> live(indexcount,false);
+    for(size_t i = 0; i < vars.size(); i++)
+        live[vars[i].mThisId] = true;
+    
+    vector<bool> keep(op_trace.size(),false);
+    vector<bool>::reverse_iterator keep_rev_it = keep.rbegin();
+    chunkedVector<size_t>::const_reverse_iterator index_trace_rev_it = index_trace.rbegin();
+    for(chunkedVector<size_t>::const_reverse_iterator op_trace_rev_it = op_trace.rbegin(); op_trace_rev_it != op_trace.rend(); ++op_trace_rev_it, ++keep_rev_it)
+    {
+        size_t op = *op_trace_rev_it;
+        size_t arity = op_arity(op);
+        size_t res = *index_trace_rev_it++;
+        
+        if(alias[res] != size_t(-1) || !live[res])
+        {
+            index_trace_rev_it += arity;
+            continue;
+        }
+        
+        *keep_rev_it = true;
+        if(op == sumconstv || op == minusconstv || op == multconstv)
+        {
+            live[linear_src[res]] = true;
+            index_trace_rev_it += arity;
+            continue;
+        }
+        
+        for(size_t i = 0; i < arity; i++)
+        {
+            size_t arg = *index_trace_rev_it++;
+            live[alias[arg] != size_t(-1) ? alias[arg] : arg] = true;
+        }
+    }
+    
+    //the kept ops with ids in order of first use
+    vector<size_t> new_id(indexcount,-1);
+    size_t count = 0;
+    chunkedVector<size_t> ops, indices;
+    chunkedVector<double> values;
+    
+    chunkedVector<size_t>::const_iterator index_trace_it = index_trace.begin();
+    chunkedVector<double>::const_iterator val_trace_it = val_trace.begin();
+    vector<bool>::const_iterator keep_it = keep.begin();
+    for(chunkedVector<size_t>::const_iterator op_trace_it = op_trace.begin(); op_trace_it != op_trace.end(); ++op_trace_it, ++keep_it)
+    {
+        size_t op = *op_trace_it;
+        size_t arity = op_arity(op);
+        size_t nvals = op_vals(op);
+        
+        if(!*keep_it)
+        {
+            index_trace_it += arity + 1;
+            val_trace_it += nvals;
+            continue;
+        }
+        
+        args.resize(arity);
+        for(size_t i = 0; i < arity; i++)
+            args[i] = *index_trace_it++;
+        size_t res = *index_trace_it++;
+        
+        vals.resize(nvals);
+        for(size_t i = 0; i < nvals; i++)
+            vals[i] = *val_trace_it++;
+        
+        fold_op(op,args,vals,res,alias,linear_src,linear_factor);
+        args.push_back(res);
+        
+        ops.push_back(op);
+        for(size_t i = 0; i < args.size(); i++)
+        {
+            if(new_id[args[i]] == size_t(-1))
+                new_id[args[i]] = count++;
+            indices.push_back(new_id[args[i]]);
+        }
+        for(size_t i = 0; i < vals.size(); i++)
+            values.push_back(vals[i]);
+    }
+    
+    for(size_t i = 0; i < vars.size(); i++)
+        if(new_id[vars[i].mThisId] == size_t(-1))
+            new_id[vars[i].mThisId] = count++;
+    
+    clear_tape();
+    for(chunkedVector<size_t>::const_iterator it = ops.begin(); it != ops.end(); ++it)
+        op_trace.push_back(*it);
+    for(chunkedVector<size_t>::const_iterator it = indices.begin(); it != indices.end(); ++it)
+        index_trace.push_back(*it);
+    for(chunkedVector<double>::const_iterator it = values.begin(); it != values.end(); ++it)
+        val_trace.push_back(*it);
+    
+    indexcount = count;
+    for(size_t i = 0; i < vars.size(); i++)
+        vars[i].mThisId = new_id[vars[i].mThisId];
+}
+
+void bdouble::map_tape(const string& path)
+{
+    release_tape();
+    
+    //a failure leaves the tape in memory
+    try
+    {
+        op_trace.map_file((path + ".ops").c_str());
+        index_trace.map_file((path + ".idx").c_str());
+        val_trace.map_file((path + ".val").c_str());
+    }
+    catch(...)
+    {
+        release_tape();
+        throw;
+    }
+}
+
+void bdouble::pack_tape(const bool& on)
+{
+    op_trace.pack(on);
+    index_trace.pack(on);
+    val_trace.pack(on);
+}
+
+void bdouble::reserve_tape(const size_t& ops,const size_t& indices,const size_t& values)
+{
+    op_trace.reserve(ops);
+    index_trace.reserve(indices);
+    val_trace.reserve(values);
+}
+
+tapeStats bdouble::tape_stats()
+{
+    tapeStats stats;
+    stats.ops = op_trace.size();
+    stats.indices = index_trace.size();
+    stats.values = val_trace.size();
+    stats.ids = indexcount;
+    stats.bytes = op_trace.bytes() + index_trace.bytes() + val_trace.bytes();
+    stats.max_nvar = mLastMaxNvar;
+    
+    stats.op_counts.assign(opcount,0);
+    for(chunkedVector<size_t>::const_iterator op_trace_it = op_trace.begin(); op_trace_it != op_trace.end(); ++op_trace_it)
+        stats.op_counts[*op_trace_it]++;
+    
+    return stats;
+}
+
+//C(nvar+order,order) coefficients and the slot to id map
+bool bdouble::coeff_memory(const size_t& nvar,const size_t& order,size_t& bytes)
+{
+    size_t count;
+    if(!combins_checked(order,nvar,count))
+        return false;
+    
+    if(count > (numeric_limits<size_t>::max() - nvar*sizeof(size_t))/sizeof(double))
+        return false;
+    
+    bytes = count*sizeof(double) + nvar*sizeof(size_t);
+    return true;
+}
+
+double bdouble::coeff_memory_estimate(const size_t& nvar,const size_t& order)
+{
+    return std::exp(lcombins(order,nvar))*sizeof(double) + (double)nvar*sizeof(size_t);
+}
+
+//flags id, reached gets the ids flagged for the first time
+inline void touch_id(const size_t& id,vector<bool>& touched,vector<size_t>* reached)
+{
+    if(!touched[id])
+    {
+        touched[id] = true;
+        if(reached)
+            reached->push_back(id);
+    }
+}
+
+//streams the ids in [end,next) still flagged, by decreasing id
+inline void stream_adjoints(size_t& next,const size_t& end,const vector<double>& adj,const vector<bool>& touched,void (*callback)(const size_t& id,const double& adjoint,void* data),void* data)
+{
+    for(; next > end; next--)
+        if(touched[next-1])
+            callback(next-1,adj[next-1],data);
+}
+
+void bdouble::adjoint_sweep(const vector<bdouble>& outputs,const vector<double>& weights,vector<double>& adj,vector<bool>& touched,const size_t& first_op,vector<size_t>* reached,void (*callback)(const size_t& id,const double& adjoint,void* data),void* data)
+{
+    if(outputs.size() != weights.size())
+        throw std::invalid_argument("adjoints: outputs and weights differ in size");
+    
+    //reused buffers are clean, they may only have to grow
+    if(reached)
+    {
+        if(adj.size() < indexcount)
+        {
+            adj.resize(indexcount,0);
+            touched.resize(indexcount,false);
+        }
+    }
+    else
+    {
+        adj.assign(indexcount,0);
+        touched.assign(indexcount,false);
+    }
+    
+    //outputs of weight 0 are not swept
+    for(size_t i = 0; i < outputs.size(); i++)
+    {
+        if(weights[i] == 0)
+            continue;
+        
+        adj[outputs[i].mThisId] += weights[i];
+        touch_id(outputs[i].mThisId,touched,reached);
+    }
+    
+    chunkedVector<size_t>::const_reverse_iterator op_trace_rev_it = op_trace.rbegin();
+    chunkedVector<size_t>::const_reverse_iterator index_trace_rev_it = index_trace.rbegin();
+    chunkedVector<double>::const_reverse_iterator val_trace_rev_it = val_trace.rbegin();
+    
+    //the ops before first_op are left alone
+    chunkedVector<size_t>::const_reverse_iterator op_trace_rev_end = op_trace.rend() - first_op;
+    
+    size_t res,arg1,arg2;
+    
+    //ids from next on are streamed already
+    size_t next = indexcount;
+    
+    for (; op_trace_rev_it!= op_trace_rev_end; ++op_trace_rev_it)
+    {
+        size_t arity = op_arity(*op_trace_rev_it);
+        
+        res = *index_trace_rev_it++;
+        
+        //results are recorded by increasing id and ops only use
+        //earlier ids, the ones above res are done
+        if(callback)
+            stream_adjoints(next,res+1,adj,touched,callback,data);
+        
+        if(!touched[res])
+        {
+            index_trace_rev_it += arity;
+            val_trace_rev_it += op_vals(*op_trace_rev_it);
+            continue;
+        }
+        
+        double temp = adj[res];
+        adj[res] = 0;
+        
+        switch(*op_trace_rev_it)
+        {
+            case bplusv:
+            case bminusv:
+                arg1 = *index_trace_rev_it++;
+                arg2 = *index_trace_rev_it++;
                 
-                while(id_it != idxes.end() && *id_it == 0)
-                    id_it++;
+                adj[arg1] += temp;
+                if(*op_trace_rev_it == bplusv)
+                    adj[arg2] += temp;
+                else
+                    adj[arg2] -= temp;
                 
-                if(id_it == idxes.end())
+                touch_id(arg1,touched,reached);
+                touch_id(arg2,touched,reached);
+                break;
+            case bmultv:
+                arg1 = *index_trace_rev_it++;
+                arg2 = *index_trace_rev_it++;
+                
+                adj[arg2] += temp * (*val_trace_rev_it++);
+                adj[arg1] += temp * (*val_trace_rev_it++);
+                
+                touch_id(arg1,touched,reached);
+                touch_id(arg2,touched,reached);
+                break;
+            case blackscholesv:
+            case lognpdfv:
+            case atan2v:
+            case hypotv:
+            case fmav:
+            case powbv:
+            case fmaxv:
+            case fminv:
+            case selectv:
+            {
+                //we skip the result, arguments were
+                //recorded in order
+                val_trace_rev_it++;
+                vector<size_t> args(arity);
+                vector<double> values(arity);
+                for(size_t i = arity; i > 0; i--)
                 {
-                    if(coarse != fine)
-                        swap(*coarse,*fine);
-                    
-                    coarse++;
+                    args[i-1] = *index_trace_rev_it++;
+                    values[i-1] = *val_trace_rev_it++;
                 }
                 
-                fine++;
+                taylorPolynomial g = TE_nary(*op_trace_rev_it,values,1);
+                vector<size_t> powers(arity,0);
+                for(size_t i = 0; i < arity; i++)
+                {
+                    powers[i] = 1;
+                    adj[args[i]] += temp*g.der(powers);
+                    powers[i] = 0;
+                    
+                    touch_id(args[i],touched,reached);
+                }
+                break;
             }
+            default:
+                arg1 = *index_trace_rev_it++;
+                adj[arg1] += temp*der_unary(*op_trace_rev_it,val_trace_rev_it);
+                touch_id(arg1,touched,reached);
         }
         
-        mId.erase(cutoff,mId.end());
-        mCoeff.resize(multisetcoeff(mId.size()+1,mOrder));
+        //res is a result so it is not streamed
+        touched[res] = false;
     }
+    
+    if(callback)
+        stream_adjoints(next,0,adj,touched,callback,data);
 }
 
-void bdouble::clear_tape()
+void bdouble::adjoints(const vector<bdouble>& outputs,const vector<double>& weights,vector<double>& res)
 {
-    op_trace.clear();
-    index_trace.clear();
-    val_trace.clear();
-    indexcount = 0;
-}
\ No newline at end of file
+    vector<bool> touched;
+    adjoint_sweep(outputs,weights,res,touched);
+}
+
+void bdouble::adjoints(const tapePosition& position,const vector<bdouble>& outputs,const vector<double>& weights,vector<double>& res)
+{
+    vector<bool> touched;
+    adjoint_sweep(outputs,weights,res,touched,position.ops);
+}
+
+void bdouble::adjoints(const vector<bdouble>& outputs,const vector<double>& weights,void (*callback)(const size_t& id,const double& adjoint,void* data),void* data)
+{
+    vector<double> adj;
+    vector<bool> touched;
+    adjoint_sweep(outputs,weights,adj,touched,0,0,callback,data);
+}
+
+void bdouble::sparsity_pattern(const vector<bdouble>& outputs,const vector<bdouble>& vars,vector<vector<size_t> >& pattern)
+{
+    vector<vector<size_t> > deps(indexcount);
+    for(size_t i = 0; i < vars.size(); i++)
+        deps[vars[i].mThisId].push_back(i);
+    
+    chunkedVector<size_t>::const_iterator index_trace_it = index_trace.begin();
+    vector<size_t> merged;
+    
+    //forward, each op records its arguments then its result
+    for(chunkedVector<size_t>::const_iterator op_trace_it = op_trace.begin(); op_trace_it != op_trace.end(); ++op_trace_it)
+    {
+        size_t arity = op_arity(*op_trace_it);
+        chunkedVector<size_t>::const_iterator args_it = index_trace_it;
+        index_trace_it += arity;
+        size_t res = *index_trace_it++;
+        
+        //res keeps its own entry if it was given as a variable
+        for(size_t i = 0; i < arity; i++)
+        {
+            const vector<size_t>& arg_deps = deps[args_it[i]];
+            merged.clear();
+            set_union(deps[res].begin(), deps[res].end(), arg_deps.begin(), arg_deps.end(), back_inserter(merged));
+            deps[res].swap(merged);
+        }
+    }
+    
+    pattern.resize(outputs.size());
+    for(size_t j = 0; j < outputs.size(); j++)
+        pattern[j] = deps[outputs[j].mThisId];
+}
+
+size_t bdouble::row_colouring(const vector<vector<size_t> >& pattern,const size_t& ncols,vector<size_t>& colours)
+{
+    colours.assign(pattern.size(),0);
+    
+    //rows already coloured in each column
+    vector<vector<size_t> > col_rows(ncols);
+    //forbidden[c] == j when colour c is taken by a neighbour of row j
+    vector<size_t> forbidden;
+    size_t ncolours = 0;
+    
+    for(size_t j = 0; j < pattern.size(); j++)
+    {
+        for(size_t c = 0; c < pattern[j].size(); c++)
+        {
+            const vector<size_t>& rows = col_rows[pattern[j][c]];
+            for(size_t r = 0; r < rows.size(); r++)
+                forbidden[colours[rows[r]]] = j;
+        }
+        
+        size_t colour = 0;
+        while(colour < ncolours && forbidden[colour] == j)
+            colour++;
+        
+        if(colour == ncolours)
+        {
+            ncolours++;
+            forbidden.push_back(j);
+        }
+        
+        colours[j] = colour;
+        for(size_t c = 0; c < pattern[j].size(); c++)
+            col_rows[pattern[j][c]].push_back(j);
+    }
+    
+    return ncolours;
+}
+
+void bdouble::sparse_jacobian(const vector<bdouble>& outputs,const vector<bdouble>& vars,vector<size_t>& rows,vector<size_t>& cols,vector<double>& values)
+{
+    vector<vector<size_t> > pattern;
+    sparsity_pattern(outputs,vars,pattern);
+    
+    vector<size_t> colours;
+    size_t ncolours = row_colouring(pattern,vars.size(),colours);
+    
+    //entries are laid out row after row
+    vector<size_t> row_start(outputs.size()+1,0);
+    for(size_t j = 0; j < outputs.size(); j++)
+        row_start[j+1] = row_start[j] + pattern[j].size();
+    
+    rows.resize(row_start.back());
+    cols.resize(row_start.back());
+    values.resize(row_start.back());
+    
+    vector<double> weights(outputs.size());
+    vector<double> adj;
+    vector<bool> touched;
+    
+    for(size_t k = 0; k < ncolours; k++)
+    {
+        for(size_t j = 0; j < outputs.size(); j++)
+            weights[j] = colours[j] == k ? 1 : 0;
+        
+        adjoint_sweep(outputs,weights,adj,touched);
+        
+        //rows of the same colour don't share variables
+        for(size_t j = 0; j < outputs.size(); j++)
+        {
+            if(colours[j] != k)
+                continue;
+            
+            for(size_t c = 0; c < pattern[j].size(); c++)
+            {
+                rows[row_start[j]+c] = j;
+                cols[row_start[j]+c] = pattern[j][c];
+                values[row_start[j]+c] = adj[vars[pattern[j][c]].mThisId];
+            }
+        }
+    }
+}
+
+//the plain liveness pass
+struct noVisitor
+{
+    void result(const size_t&) {}
+    void argument(const size_t&) {}
+};
+
+void bdouble::relevant_ops(const size_t& id,vector<bool>& op_relevant,vector<bool>& var_concerned)
+{
+    noVisitor visitor;
+    relevant_ops(id,op_relevant,var_concerned,visitor);
+}
+
+vector<size_t> bdouble::dependencies() const
+{
+    vector<bool> op_relevant, var_concerned;
+    relevant_ops(mThisId,op_relevant,var_concerned);
+    
+    //results of relevant ops are not variables
+    chunkedVector<size_t>::const_iterator index_trace_it = index_trace.begin();
+    for(size_t op = 0; op < op_trace.size(); op++)
+    {
+        index_trace_it += op_arity(op_trace[op]);
+        if(op_relevant[op])
+            var_concerned[*index_trace_it] = false;
+        index_trace_it++;
+    }
+    
+    vector<size_t> res;
+    for(size_t i = 0; i < indexcount; i++)
+        if(var_concerned[i])
+            res.push_back(i);
+    
+    return res;
+}
+
+vector<size_t> bdouble::dependencies(vector<pair<size_t,size_t> >& interactions) const
+{
+    vector<bool> op_relevant, var_concerned;
+    relevant_ops(mThisId,op_relevant,var_concerned);
+    
+    //variables each id depends on, filled forward. ids that
+    //are not computed by an op depend on themselves
+    vector<vector<size_t> > deps(indexcount);
+    vector<bool> computed(indexcount,false);
+    set<pair<size_t,size_t> > pairs;
+    vector<size_t> merged;
+    
+    chunkedVector<size_t>::const_iterator index_trace_it = index_trace.begin();
+    for(size_t op = 0; op < op_trace.size(); op++)
+    {
+        size_t arity = op_arity(op_trace[op]);
+        chunkedVector<size_t>::const_iterator args_it = index_trace_it;
+        index_trace_it += arity;
+        size_t res = *index_trace_it++;
+        
+        if(!op_relevant[op])
+            continue;
+        
+        computed[res] = true;
+        
+        vector<size_t>& res_deps = deps[res];
+        for(size_t i = 0; i < arity; i++)
+        {
+            if(!computed[args_it[i]] && deps[args_it[i]].empty())
+                deps[args_it[i]].push_back(args_it[i]);
+            
+            const vector<size_t>& arg_deps = deps[args_it[i]];
+            merged.clear();
+            set_union(res_deps.begin(), res_deps.end(), arg_deps.begin(), arg_deps.end(), back_inserter(merged));
+            res_deps.swap(merged);
+        }
+        
+        switch(op_trace[op])
+        {
+            //linear ops don't create interactions
+            case bplusv:
+            case bminusv:
+            case sumconstv:
+            case minusconstv:
+            case multconstv:
+                break;
+            //the product only mixes one side with the other
+            case bmultv:
+            {
+                const vector<size_t>& lhs = deps[args_it[1]];
+                const vector<size_t>& rhs = deps[args_it[0]];
+                for(size_t i = 0; i < lhs.size(); i++)
+                    for(size_t j = 0; j < rhs.size(); j++)
+                        pairs.insert(make_pair(min(lhs[i],rhs[j]),max(lhs[i],rhs[j])));
+                break;
+            }
+            default:
+                for(size_t i = 0; i < res_deps.size(); i++)
+                    for(size_t j = i; j < res_deps.size(); j++)
+                        pairs.insert(make_pair(res_deps[i],res_deps[j]));
+        }
+    }
+    
+    interactions.assign(pairs.begin(),pairs.end());
+    
+    if(!computed[mThisId])
+        return vector<size_t>(1,mThisId);
+    
+    return deps[mThisId];
+}
+
+tapePrefix::tapePrefix(const vector<bdouble>& nodes,const vector<bdouble>& quotes)
+{
+    mPosition = bdouble::tape_position();
+    mQuotes = quotes;
+    
+    //a node that is a quote or that is given twice would
+    //be counted twice by gradient
+    vector<size_t> seen;
+    for(size_t j = 0; j < quotes.size(); j++)
+        seen.push_back(quotes[j].id());
+    sort(seen.begin(), seen.end());
+    
+    for(size_t i = 0; i < nodes.size(); i++)
+    {
+        vector<size_t>::iterator it = lower_bound(seen.begin(), seen.end(), nodes[i].id());
+        if(it == seen.end() || *it != nodes[i].id())
+        {
+            seen.insert(it,nodes[i].id());
+            mNodes.push_back(nodes[i]);
+        }
+    }
+    
+    vector<size_t> rows;
+    bdouble::sparse_jacobian(mNodes,quotes,rows,mCols,mValues);
+    
+    //rows are in order, we only keep where each starts
+    mRowStart.assign(mNodes.size()+1,0);
+    for(size_t e = 0; e < rows.size(); e++)
+        mRowStart[rows[e]+1]++;
+    for(size_t i = 0; i < mNodes.size(); i++)
+        mRowStart[i+1] += mRowStart[i];
+}
+
+vector<double> tapePrefix::gradient(const vector<bdouble>& outputs,const vector<double>& weights) const
+{
+    bdouble::adjoint_sweep(outputs,weights,mAdj,mTouched,mPosition.ops,&mReached);
+    
+    //the suffix may use the quotes directly
+    vector<double> res(mQuotes.size());
+    for(size_t j = 0; j < mQuotes.size(); j++)
+        res[j] = mAdj[mQuotes[j].id()];
+    
+    for(size_t i = 0; i < mNodes.size(); i++)
+    {
+        double node_adj = mAdj[mNodes[i].id()];
+        if(node_adj == 0)
+            continue;
+        
+        for(size_t e = mRowStart[i]; e < mRowStart[i+1]; e++)
+            res[mCols[e]] += node_adj*mValues[e];
+    }
+    
+    for(size_t k = 0; k < mReached.size(); k++)
+    {
+        mAdj[mReached[k]] = 0;
+        mTouched[mReached[k]] = false;
+    }
+    mReached.clear();
+    
+    return res;
+}
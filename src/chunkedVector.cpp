@@ -0,0 +1,105 @@
+//          Copyright Juan Lucas Rey 2015 - 2016.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include "chunkedVector.h"
+#include <cstring>
+#include <stdint.h>
+
+//values that aren't in the dictionary are tagged with this
+//and follow as they are
+const unsigned char literal_tag = 255;
+
+void pack_chunk(const size_t* in, const size_t& n, vector<unsigned char>& out)
+{
+    out.clear();
+    
+    size_t previous = 0;
+    for(size_t i = 0; i < n; i++)
+    {
+        //zigzag so that small negative steps stay short
+        int64_t delta = int64_t(in[i] - previous);
+        uint64_t zigzag = (uint64_t(delta) << 1) ^ uint64_t(delta >> 63);
+        previous = in[i];
+        
+        while(zigzag >= 0x80)
+        {
+            out.push_back((unsigned char)(zigzag | 0x80));
+            zigzag >>= 7;
+        }
+        out.push_back((unsigned char)zigzag);
+    }
+}
+
+void unpack_chunk(const vector<unsigned char>& in, const size_t& n, size_t* out)
+{
+    const unsigned char* pos = in.data();
+    
+    size_t previous = 0;
+    for(size_t i = 0; i < n; i++)
+    {
+        uint64_t zigzag = 0;
+        size_t shift = 0;
+        while(*pos & 0x80)
+        {
+            zigzag |= uint64_t(*pos++ & 0x7f) << shift;
+            shift += 7;
+        }
+        zigzag |= uint64_t(*pos++) << shift;
+        
+        int64_t delta = int64_t(zigzag >> 1) ^ -int64_t(zigzag & 1);
+        previous += size_t(delta);
+        out[i] = previous;
+    }
+}
+
+//slot of a bit pattern in the dictionary
+inline size_t dictionary_slot(const uint64_t& bits)
+{
+    return size_t((bits * 0x9E3779B97F4A7C15ULL) >> 32) % literal_tag;
+}
+
+void pack_chunk(const double* in, const size_t& n, vector<unsigned char>& out)
+{
+    out.clear();
+    
+    vector<uint64_t> dictionary(literal_tag,0);
+    for(size_t i = 0; i < n; i++)
+    {
+        uint64_t bits;
+        memcpy(&bits, &in[i], sizeof(bits));
+        
+        size_t slot = dictionary_slot(bits);
+        if(dictionary[slot] == bits)
+            out.push_back((unsigned char)slot);
+        else
+        {
+            dictionary[slot] = bits;
+            out.push_back(literal_tag);
+            const unsigned char* bytes = (const unsigned char*)&bits;
+            out.insert(out.end(), bytes, bytes + sizeof(bits));
+        }
+    }
+}
+
+void unpack_chunk(const vector<unsigned char>& in, const size_t& n, double* out)
+{
+    const unsigned char* pos = in.data();
+    
+    vector<uint64_t> dictionary(literal_tag,0);
+    for(size_t i = 0; i < n; i++)
+    {
+        uint64_t bits;
+        if(*pos == literal_tag)
+        {
+            memcpy(&bits, pos+1, sizeof(bits));
+            pos += 1 + sizeof(bits);
+            dictionary[dictionary_slot(bits)] = bits;
+        }
+        else
+            bits = dictionary[*pos++];
+        
+        memcpy(&out[i], &bits, sizeof(bits));
+    }
+}
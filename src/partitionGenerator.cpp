@@ -55,32 +55,34 @@ bool partitionGenerator::next(vector<size_t>& b)
 
 size_t partitionGenerator::multiplicity(const vector<size_t>& b)
 {
-    if(factorials.empty())
-    {
-        factorials.resize(n+1);
-        
-        //by convention
-        factorials[0] = 1;
-        for(size_t i=1; i<=n; i++)
-            factorials[i] = i*factorials[i-1];
-    }
-    
-    size_t mult = factorials.back();
-    
-    //I only care if there are at least two elements of the same value, so
-    //it means that I only care for values up to int(n/2)
-    //this whole thing will be cached anyway so I'm not looking for
-    //efficiency here..
-    vector<size_t> elements_counter(n);
-    for (vector<size_t>::const_iterator it = b.begin(); it!=b.end(); ++it)
-    {
-        mult /= factorials[*it];
-        elements_counter[(*it)-1]++;
-    }
+    return partitionmultiplicity(b.data(),b.size(),n);
+}
+
+//number of set partitions with blocks of the given sizes: the
+//elements of the blocks of size v are chosen among the ones left,
+//then split into blocks that each take the smallest element left.
+//b is sorted so that equal sizes are next to each other.
+size_t partitionmultiplicity(const size_t* b,const size_t& size,const size_t& n)
+{
+    size_t mult = 1;
+    size_t left = n;
     
-    for (vector<size_t>::const_iterator it = elements_counter.begin(); it!=elements_counter.end(); ++it)
+    size_t i = 0;
+    while(i != size)
     {
-        mult /= factorials[*it];
+        size_t part = b[i];
+        size_t count = 0;
+        while(i != size && b[i] == part)
+        {
+            count++;
+            i++;
+        }
+        
+        mult = mult_checked(mult,combins(part*count,left,true));
+        for(size_t j = count; j > 1; j--)
+            mult = mult_checked(mult,combins(part-1,j*part-1,true));
+        
+        left -= part*count;
     }
     
     return mult;
@@ -139,28 +141,51 @@ multisetGenerator::multisetGenerator(const size_t& casesin,const size_t& unitsin
     cases = casesin;
     units = unitsin;
     first = true;
+    beginrank = 0;
+    endrank = numeric_limits<size_t>::max();
+    currentrank = 0;
+}
+
+multisetGenerator::multisetGenerator(const size_t& casesin,const size_t& unitsin,const size_t& beginrankin,const size_t& endrankin)
+{
+    cases = casesin;
+    units = unitsin;
+    first = true;
+    beginrank = beginrankin;
+    endrank = min(endrankin,multisetcoeff(cases,units));
+    currentrank = 0;
 }
 
 bool multisetGenerator::next(vector<size_t>& b)
 {
     if(first)
     {
-        //b.clear();
-        //b.resize(cases,0);
-        
-        //vs
-        if(b.size() != cases)
-            b.resize(cases);
+        if(beginrank >= endrank)
+            return false;
         
-        std::fill(b.begin(), b.end(), 0);
+        if(beginrank != 0)
+            multisetunrank(beginrank,cases,units,b);
+        else
+        {
+            //b.clear();
+            //b.resize(cases,0);
+            
+            //vs
+            if(b.size() != cases)
+                b.resize(cases);
+            
+            std::fill(b.begin(), b.end(), 0);
+            
+            b[0] = units;
+        }
         
-        b[0] = units;
+        currentrank = beginrank;
         first = false;
         return true;
     }
     else
     {
-        if(b.back() == units)
+        if(b.back() == units || currentrank+1 >= endrank)
             return false;
         else
         {
@@ -178,6 +203,7 @@ bool multisetGenerator::next(vector<size_t>& b)
                 b.back() = 0;
             }
             
+            currentrank++;
             return true;
         }
     }
@@ -187,22 +213,35 @@ bool multisetGenerator::prev(vector<size_t>& b)
 {
     if(first)
     {
-        //b.clear();
-        //b.resize(cases,0);
-        
-        //vs
-        if(b.size() != cases)
-            b.resize(cases);
+        if(beginrank >= endrank)
+            return false;
         
-        std::fill(b.begin(), b.end(), 0);
+        if(endrank != numeric_limits<size_t>::max())
+        {
+            currentrank = endrank-1;
+            multisetunrank(currentrank,cases,units,b);
+        }
+        else
+        {
+            //b.clear();
+            //b.resize(cases,0);
+            
+            //vs
+            if(b.size() != cases)
+                b.resize(cases);
+            
+            std::fill(b.begin(), b.end(), 0);
+            
+            b.back() = units;
+            currentrank = multisetcoeff(cases,units)-1;
+        }
         
-        b.back() = units;
         first = false;
         return true;
     }
     else
     {
-        if(b.front() == units)
+        if(b.front() == units || currentrank <= beginrank)
             return false;
         else
         {
@@ -220,11 +259,105 @@ bool multisetGenerator::prev(vector<size_t>& b)
                 b[i] = 0;
             }
             
+            currentrank--;
             return true;
         }
     }
 }
 
+multisetRanker::multisetRanker(const size_t& casesin,const size_t& unitsin,const vector<size_t>& positionsin)
+{
+    cases = casesin;
+    units = unitsin;
+    
+    positions_order.resize(positionsin.size());
+    for(size_t i = 0; i < positions_order.size(); i++)
+        positions_order[i] = i;
+    
+    for(size_t i = 1; i < positions_order.size(); i++)
+        for(size_t j = i; j > 0 && positionsin[positions_order[j-1]] > positionsin[positions_order[j]]; j--)
+            swap(positions_order[j-1],positions_order[j]);
+    
+    positions.resize(positionsin.size());
+    for(size_t i = 0; i < positions.size(); i++)
+        positions[i] = positionsin[positions_order[i]];
+    
+    base = 0;
+    offsets.resize(positions.size()*(units+1),0);
+}
+
+//multisetcount is the sum over p > 0 of combins(cases-p,S_p-1)
+//where S_p is the number of units at p or after, when S_p > 0.
+//moving units from 0 to a position q adds them to S_p for p <= q.
+void multisetRanker::set(const vector<size_t>& b)
+{
+    base = 0;
+    std::fill(offsets.begin(), offsets.end(), 0);
+    
+    size_t segment = positions.size();
+    size_t suffix = 0;
+    for(size_t p = cases-1; p > 0; p--)
+    {
+        suffix += b[p];
+        
+        while(segment > 0 && p <= positions[segment-1])
+            segment--;
+        
+        if(segment == positions.size())
+        {
+            if(suffix > 0)
+                base += combins(cases-p,suffix-1);
+        }
+        else
+        {
+            size_t* offset = &offsets[segment*(units+1)];
+            for(size_t moved = 0; moved+suffix <= units; moved++)
+                if(moved+suffix > 0)
+                    offset[moved] += combins(cases-p,moved+suffix-1);
+        }
+    }
+}
+
+size_t multisetRanker::rank(const size_t* moved) const
+{
+    size_t res = base;
+    size_t total = 0;
+    for(size_t i = positions.size(); i > 0; i--)
+    {
+        total += moved[positions_order[i-1]];
+        res += offsets[(i-1)*(units+1)+total];
+    }
+    
+    return res;
+}
+
+//at each position the ranks of the multisets with b[i] = v
+//start at combins(m-i-1,ballsLeft-v-1), which decreases with v
+void multisetunrank(size_t rank,const size_t& cases,const size_t& units,vector<size_t>& b)
+{
+    if(b.size() != cases)
+        b.resize(cases);
+    
+    std::fill(b.begin(), b.end(), 0);
+    
+    size_t ballsLeft = units;
+    for(size_t i = 0; ballsLeft != 0 && i+1 < cases; i++)
+    {
+        size_t v = 0;
+        while(v < ballsLeft && combins(cases-i-1,ballsLeft-v-1) > rank)
+            v++;
+        
+        if(v < ballsLeft)
+            rank -= combins(cases-i-1,ballsLeft-v-1);
+        
+        b[i] = v;
+        ballsLeft -= v;
+    }
+    
+    if(ballsLeft != 0)
+        b.back() = ballsLeft;
+}
+
 combinationGenerator::combinationGenerator(const size_t& casesin, const size_t& basein)
 {
     cases = casesin;
@@ -263,3 +396,72 @@ bool combinationGenerator::next(vector<size_t>& b)
         return true;
     }
 }
+
+combinatoricsTables::combinatoricsTables()
+{
+    //pascal triangle, C(k+n,k) = C(k+n-1,k-1) + C(k+n-1,k)
+    for(size_t k = 0; k < ADHOC_COMBINS_MAX_K; k++)
+        for(size_t n = 0; n < ADHOC_COMBINS_MAX_N; n++)
+        {
+            if(k == 0 || n == 0)
+                binomials[k][n] = 1;
+            else
+            {
+                size_t lhs = binomials[k-1][n];
+                size_t rhs = binomials[k][n-1];
+                if(lhs > numeric_limits<size_t>::max() - rhs)
+                    binomials[k][n] = numeric_limits<size_t>::max();
+                else
+                    binomials[k][n] = lhs + rhs;
+            }
+        }
+    
+    factorials[0] = 1;
+    for(size_t i = 1; i <= factorials_max; i++)
+        factorials[i] = i*factorials[i-1];
+}
+
+//partitions up to ADHOC_PARTITIONS_MAX with their multiplicities,
+//which need the binomials, so they are kept apart from them
+vector<vector<partitionEntry> > build_partition_tables()
+{
+    //partitions of 0 are left empty
+    vector<vector<partitionEntry> > res(ADHOC_PARTITIONS_MAX+1);
+    for(size_t i = 1; i <= ADHOC_PARTITIONS_MAX; i++)
+    {
+        partitionEntry entry;
+        partitionGenerator pg(i);
+        while(pg.next(entry.parts))
+        {
+            entry.multiplicity = pg.multiplicity(entry.parts);
+            res[i].push_back(entry);
+        }
+    }
+    
+    return res;
+}
+
+//built on first use like combinatorics_tables
+const vector<vector<partitionEntry> >& partition_tables()
+{
+    static const vector<vector<partitionEntry> > tables = build_partition_tables();
+    return tables;
+}
+
+const vector<partitionEntry>& partitions(const size_t& n,vector<partitionEntry>& buffer)
+{
+    if(n <= ADHOC_PARTITIONS_MAX)
+        return partition_tables()[n];
+    
+    buffer.clear();
+    
+    partitionEntry entry;
+    partitionGenerator pg(n);
+    while(pg.next(entry.parts))
+    {
+        entry.multiplicity = pg.multiplicity(entry.parts);
+        buffer.push_back(entry);
+    }
+    
+    return buffer;
+}
@@ -0,0 +1,167 @@
+//          Copyright Juan Lucas Rey 2015 - 2016.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include "taylorPolynomial.h"
+#include "partitionGenerator.h"
+
+taylorPolynomial::taylorPolynomial(const size_t& nvarin, const size_t& orderin, const kdouble& value)
+{
+    mNvar = nvarin;
+    mOrder = orderin;
+    mCoeff.resize(multisetcoeff(mNvar+1,mOrder),0);
+    mCoeff[0] = value;
+}
+
+taylorPolynomial taylorPolynomial::variable(const size_t& nvarin, const size_t& orderin, const size_t& var, const kdouble& value)
+{
+    taylorPolynomial res(nvarin,orderin,value);
+    
+    if(orderin > 0)
+    {
+        vector<size_t> idxes(nvarin+1,0);
+        idxes[0] = orderin-1;
+        idxes[var+1] = 1;
+        res.mCoeff[multisetcount(idxes,orderin)] = 1;
+    }
+    
+    return res;
+}
+
+taylorPolynomial taylorPolynomial::operator+(const taylorPolynomial& rhs) const
+{
+    taylorPolynomial res(*this);
+    for(size_t i = 0; i < mCoeff.size(); i++)
+        res.mCoeff[i] += rhs.mCoeff[i];
+    
+    return res;
+}
+
+taylorPolynomial taylorPolynomial::operator-(const taylorPolynomial& rhs) const
+{
+    taylorPolynomial res(*this);
+    for(size_t i = 0; i < mCoeff.size(); i++)
+        res.mCoeff[i] -= rhs.mCoeff[i];
+    
+    return res;
+}
+
+taylorPolynomial taylorPolynomial::operator*(const taylorPolynomial& rhs) const
+{
+    taylorPolynomial res(mNvar,mOrder);
+    
+    vector<size_t> lhs_idxes, rhs_idxes;
+    vector<size_t> res_idxes(mNvar+1,0);
+    vector<size_t> rhs_full_idxes(mNvar+1,0);
+    
+    multisetGenerator mg_lhs(mNvar+1,mOrder);
+    size_t lhs_pos = 0;
+    while(mg_lhs.next(lhs_idxes))
+    {
+        if(mCoeff[lhs_pos] != 0)
+        {
+            //the order of rhs terms can't exceed what's left
+            multisetGenerator mg_rhs(mNvar+1,lhs_idxes[0]);
+            size_t lhs_order = mOrder - lhs_idxes[0];
+            while(mg_rhs.next(rhs_idxes))
+            {
+                res_idxes[0] = rhs_idxes[0];
+                for(size_t i = 1; i <= mNvar; i++)
+                    res_idxes[i] = lhs_idxes[i] + rhs_idxes[i];
+                
+                //rhs_idxes lives in a polynomial of lower order
+                //so its position has to be computed at full order
+                rhs_full_idxes = rhs_idxes;
+                rhs_full_idxes[0] += lhs_order;
+                const kdouble& rhs_coeff = rhs.mCoeff[multisetcount(rhs_full_idxes,mOrder)];
+                if(rhs_coeff != 0)
+                    res.mCoeff[multisetcount(res_idxes,mOrder)] += mCoeff[lhs_pos]*rhs_coeff;
+            }
+        }
+        
+        lhs_pos++;
+    }
+    
+    return res;
+}
+
+taylorPolynomial taylorPolynomial::operator+(const kdouble& rhs) const
+{
+    taylorPolynomial res(*this);
+    res.mCoeff[0] += rhs;
+    return res;
+}
+
+taylorPolynomial taylorPolynomial::operator*(const kdouble& rhs) const
+{
+    taylorPolynomial res(*this);
+    for(size_t i = 0; i < mCoeff.size(); i++)
+        res.mCoeff[i] *= rhs;
+    
+    return res;
+}
+
+taylorPolynomial taylorPolynomial::compose(const vector<kdouble>& taylorexp) const
+{
+    //horner scheme on (this - value)
+    taylorPolynomial shift(*this);
+    shift.mCoeff[0] = 0;
+    
+    vector<kdouble> factorials(mOrder+1,1);
+    for(size_t i = 1; i <= mOrder; i++)
+        factorials[i] = factorials[i-1]*i;
+    
+    taylorPolynomial res(mNvar,mOrder,taylorexp[mOrder]/factorials[mOrder]);
+    for(size_t i = mOrder; i > 0; i--)
+        res = res*shift + taylorexp[i-1]/factorials[i-1];
+    
+    return res;
+}
+
+taylorPolynomial taylorPolynomial::substitute(const vector<size_t>& var_map, const size_t& nvarout) const
+{
+    taylorPolynomial res(nvarout,mOrder);
+    
+    vector<size_t> idxes;
+    vector<size_t> res_idxes(nvarout+1,0);
+    
+    multisetGenerator mg(mNvar+1,mOrder);
+    size_t pos = 0;
+    while(mg.next(idxes))
+    {
+        if(mCoeff[pos] != 0)
+        {
+            std::fill(res_idxes.begin(), res_idxes.end(), 0);
+            res_idxes[0] = idxes[0];
+            for(size_t i = 0; i < mNvar; i++)
+                res_idxes[var_map[i]+1] += idxes[i+1];
+            
+            res.mCoeff[multisetcount(res_idxes,mOrder)] += mCoeff[pos];
+        }
+        
+        pos++;
+    }
+    
+    return res;
+}
+
+kdouble taylorPolynomial::der(const vector<size_t>& powers) const
+{
+    vector<size_t> idxes(mNvar+1,0);
+    idxes[0] = mOrder;
+    
+    kdouble factor = 1;
+    for(size_t i = 0; i < mNvar; i++)
+    {
+        if(powers[i] > idxes[0])
+            return 0;
+        
+        idxes[i+1] = powers[i];
+        idxes[0] -= powers[i];
+        for(size_t j = 2; j <= powers[i]; j++)
+            factor *= j;
+    }
+    
+    return mCoeff[multisetcount(idxes,mOrder)]*factor;
+}
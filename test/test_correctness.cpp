@@ -6,7 +6,13 @@
 #define BOOST_TEST_MODULE test module name
 #include <boost/test/included/unit_test.hpp>
 #include <boost/test/floating_point_comparison.hpp>
+#include <map>
+#include <cstring>
+#include <fstream>
+#include <iterator>
 #include "bdouble.h"
+#include "partitionGenerator.h"
+#include "chunkedVector.h"
 
 BOOST_AUTO_TEST_CASE( Multiplication )
 {
@@ -961,6 +967,46 @@ BOOST_AUTO_TEST_CASE(test_pow_both_h)
     bdouble::clear_tape();
 }
 
+BOOST_AUTO_TEST_CASE(test_pow_both_h2)
+{
+    bdouble::clear_tape();
+    bdouble::setOrder(4);
+    double testvalue,der;
+    
+    bdouble x1 = 0.5;
+    bdouble x2 = 5.5;
+    bdouble y = pow(x1,x2)*pow(2.5,x1);
+    
+    //same formula recorded op by op
+    bdouble y2 = exp(log(x1)*x2)*exp(x1*log(2.5));
+    
+    vector<bdouble> vars;
+    vars.push_back(x1);
+    vars.push_back(x2);
+    
+    for(size_t i = 0; i < vars.size(); i++)
+        for(size_t j = 0; j < vars.size(); j++)
+            for(size_t k = 0; k < vars.size(); k++)
+                for(size_t l = 0; l < vars.size(); l++)
+                {
+                    der = y.der(vars[i],vars[j],vars[k],vars[l]);
+                    testvalue = y2.der(vars[i],vars[j],vars[k],vars[l]);
+                    BOOST_CHECK_SMALL(der-testvalue,0.0000000001);
+                }
+    
+    //x^x
+    bdouble z = pow(x1,x1);
+    testvalue = pow(0.5,0.5)*(1.0+log(0.5));
+    der = z.der(x1);
+    BOOST_CHECK_SMALL(der-testvalue,0.000000000000001);
+    
+    testvalue = pow(0.5,0.5)*((1.0+log(0.5))*(1.0+log(0.5)) + 1.0/0.5);
+    der = z.der(x1,2);
+    BOOST_CHECK_SMALL(der-testvalue,0.00000000000001);
+    
+    bdouble::clear_tape();
+}
+
 BOOST_AUTO_TEST_CASE(test_sqrt)
 {
     bdouble::clear_tape();
@@ -1555,6 +1601,51 @@ BOOST_AUTO_TEST_CASE(test_n_h)
     bdouble::clear_tape();
 }
 
+BOOST_AUTO_TEST_CASE(test_npdf)
+{
+    bdouble::clear_tape();
+    bdouble::setOrder(1);
+    double testvalue,der;
+    
+    bdouble x = 0.8;
+    bdouble y = npdf(x);
+    
+    testvalue = exp(-0.32)/sqrt(2*M_PI);
+    der = y;
+    BOOST_CHECK_SMALL(der-testvalue,0.000000000000001);
+    
+    testvalue = -0.8*exp(-0.32)/sqrt(2*M_PI);
+    der = y.der(x);
+    BOOST_CHECK_SMALL(der-testvalue,0.000000000000001);
+    
+    bdouble::clear_tape();
+}
+
+BOOST_AUTO_TEST_CASE(test_npdf_h)
+{
+    bdouble::clear_tape();
+    bdouble::setOrder(4);
+    double testvalue,der;
+    
+    bdouble x = 0.8;
+    bdouble y = npdf(x);
+    
+    //hermite polynomials
+    testvalue = (0.64-1.0)*exp(-0.32)/sqrt(2*M_PI);
+    der = y.der(x,2);
+    BOOST_CHECK_SMALL(der-testvalue,0.000000000000001);
+    
+    testvalue = -(0.512-2.4)*exp(-0.32)/sqrt(2*M_PI);
+    der = y.der(x,3);
+    BOOST_CHECK_SMALL(der-testvalue,0.000000000000001);
+    
+    testvalue = (0.4096-3.84+3.0)*exp(-0.32)/sqrt(2*M_PI);
+    der = y.der(x,4);
+    BOOST_CHECK_SMALL(der-testvalue,0.000000000000001);
+    
+    bdouble::clear_tape();
+}
+
 BOOST_AUTO_TEST_CASE(test_tan)
 {
     bdouble::clear_tape();
@@ -1987,6 +2078,22 @@ BOOST_AUTO_TEST_CASE(test_atanh_h)
     bdouble::clear_tape();
 }
 
+BOOST_AUTO_TEST_CASE(test_atanh_order6)
+{
+    bdouble::clear_tape();
+    bdouble::setOrder(6);
+    double testvalue,der;
+    
+    bdouble x = 0.35;
+    bdouble y=atanh(x);
+    
+    //d^n/dx^n atanh(x) = (n-1)!/2 * ((-1)^(n-1)/(1+x)^n + 1/(1-x)^n)
+    testvalue = 60.0*(1.0/pow(0.65,6) - 1.0/pow(1.35,6));
+    der = y.der(x,6);
+    BOOST_CHECK_SMALL(der-testvalue,0.000000001);
+    
+    bdouble::clear_tape();
+}
 BOOST_AUTO_TEST_CASE(test_lgamma)
 {
     bdouble::clear_tape();
@@ -3218,6 +3325,87 @@ BOOST_AUTO_TEST_CASE(test_atan2)
     BOOST_CHECK_SMALL(der-testvalue,0.00001);
 }
 
+BOOST_AUTO_TEST_CASE(test_atan2_quadrant)
+{
+    bdouble::clear_tape();
+    bdouble::setOrder(2);
+    double testvalue,der;
+    
+    bdouble x = 0.5;
+    bdouble y = -0.8;
+    
+    bdouble result = atan2(x,y);
+    bdouble result2 = atan2(x,-0.8);
+    
+    der = result;
+    testvalue = atan2(0.5,-0.8);
+    BOOST_CHECK_EQUAL(der,testvalue);
+    
+    der = result2;
+    BOOST_CHECK_SMALL(der-testvalue,0.000000000000001);
+    
+    testvalue = -0.8/0.89;
+    der = result.der(x);
+    BOOST_CHECK_SMALL(der-testvalue,0.000000000000001);
+    der = result2.der(x);
+    BOOST_CHECK_SMALL(der-testvalue,0.000000000000001);
+    
+    testvalue = -0.5/0.89;
+    der = result.der(y);
+    BOOST_CHECK_SMALL(der-testvalue,0.000000000000001);
+    
+    //d2/dx2 = -2xy/(x^2+y^2)^2
+    testvalue = 0.8/(0.89*0.89);
+    der = result.der(x,2);
+    BOOST_CHECK_SMALL(der-testvalue,0.000000000000001);
+    der = result2.der(x,2);
+    BOOST_CHECK_SMALL(der-testvalue,0.000000000000001);
+    
+    //d2/dxdy = (x^2-y^2)/(x^2+y^2)^2
+    testvalue = (0.25-0.64)/(0.89*0.89);
+    der = result.der(x,y);
+    BOOST_CHECK_SMALL(der-testvalue,0.000000000000001);
+    
+    bdouble::clear_tape();
+}
+
+BOOST_AUTO_TEST_CASE(test_hypot_fma_h)
+{
+    bdouble::clear_tape();
+    bdouble::setOrder(3);
+    
+    bdouble x = 0.5;
+    bdouble y = 0.8;
+    bdouble z = 0.7;
+    
+    bdouble result = hypot(x,y)*fma(x,y,z);
+    
+    //same formula recorded op by op
+    bdouble result2 = sqrt(x*x+y*y)*(x*y+z);
+    
+    vector<bdouble> vars;
+    vars.push_back(x);
+    vars.push_back(y);
+    vars.push_back(z);
+    
+    for(size_t i = 0; i < vars.size(); i++)
+        for(size_t j = 0; j < vars.size(); j++)
+            for(size_t k = 0; k < vars.size(); k++)
+            {
+                double der = result.der(vars[i],vars[j],vars[k]);
+                double testvalue = result2.der(vars[i],vars[j],vars[k]);
+                BOOST_CHECK_SMALL(der-testvalue,0.000000000001);
+            }
+    
+    //the same variable twice
+    bdouble square = fma(x,x,z);
+    BOOST_CHECK_EQUAL(square.der(x),1.0);
+    BOOST_CHECK_EQUAL(square.der(x,2),2.0);
+    BOOST_CHECK_EQUAL(square.der(x,z),0.0);
+    
+    bdouble::clear_tape();
+}
+
 BOOST_AUTO_TEST_CASE(test_plusequal)
 {
     bdouble::clear_tape();
@@ -3257,4 +3445,1440 @@ BOOST_AUTO_TEST_CASE(test_plusequal)
     der = x.der(z_id,2);
     testvalue = 0;
     BOOST_CHECK_EQUAL(der,testvalue);
-}
\ No newline at end of file
+}
+
+BOOST_AUTO_TEST_CASE(test_mul_cross_h)
+{
+    bdouble::clear_tape();
+    bdouble::setOrder(4);
+    double testvalue,der;
+    
+    bdouble x = 1.3;
+    bdouble y = 0.2;
+    
+    bdouble res = pow(x*y,2);
+    
+    testvalue = 4.0;
+    der = res.der(x,2,y,2);
+    BOOST_CHECK_SMALL(der-testvalue,0.000000000001);
+    
+    bdouble::clear_tape();
+}
+
+BOOST_AUTO_TEST_CASE(test_bmult_order4)
+{
+    bdouble::clear_tape();
+    bdouble::setOrder(4);
+    
+    bdouble x = 1.3;
+    bdouble y = 0.7;
+    
+    //two products with different ids so that the last one
+    //is recorded as bmult and not as a square
+    bdouble u = x*y;
+    bdouble v = x*y;
+    bdouble f = u*v;
+    
+    //f = x^2 y^2
+    BOOST_CHECK_CLOSE(f.der(x,x,y,y),4.0,1e-10);
+    BOOST_CHECK_CLOSE(f.der(x,x,y),4*0.7,1e-10);
+    BOOST_CHECK_CLOSE(f.der(x,y),4*1.3*0.7,1e-10);
+    BOOST_CHECK_SMALL(f.der(x,x,x),1e-12);
+    
+    bdouble::clear_tape();
+}
+
+BOOST_AUTO_TEST_CASE(test_nary_arg_order)
+{
+    //the same op with its arguments recorded in order and in
+    //reverse order, the slots of the sweep must not depend on it
+    for(size_t order = 1; order <= 2; order++)
+    {
+        bdouble::clear_tape();
+        bdouble::setOrder(order);
+        
+        bdouble F = 1.1;
+        bdouble K = 1.0;
+        bdouble sigma = 0.2;
+        bdouble T = 2.0;
+        
+        bdouble T2 = 2.0;
+        bdouble sigma2 = 0.2;
+        bdouble K2 = 1.0;
+        bdouble F2 = 1.1;
+        
+        bdouble out = blackscholes(F*F,K,sigma,T)*F;
+        bdouble out2 = blackscholes(F2*F2,K2,sigma2,T2)*F2;
+        
+        vector<bdouble> vars;
+        vars.push_back(F);
+        vars.push_back(K);
+        vars.push_back(sigma);
+        vars.push_back(T);
+        
+        vector<bdouble> vars2;
+        vars2.push_back(F2);
+        vars2.push_back(K2);
+        vars2.push_back(sigma2);
+        vars2.push_back(T2);
+        
+        vector<double> grad = out.tensor(vars,order);
+        vector<double> grad2 = out2.tensor(vars2,order);
+        for(size_t i = 0; i < grad.size(); i++)
+            BOOST_CHECK_CLOSE(grad2[i],grad[i],1e-10);
+    }
+    
+    bdouble::clear_tape();
+}
+
+BOOST_AUTO_TEST_CASE(test_blackscholes)
+{
+    bdouble::clear_tape();
+    bdouble::setOrder(2);
+    double testvalue,der;
+    
+    bdouble F = 100.0;
+    bdouble K = 95.0;
+    bdouble sigma = 0.2;
+    bdouble T = 1.5;
+    
+    bdouble price = blackscholes(F,K,sigma,T);
+    
+    double stdev = 0.2*sqrt(1.5);
+    double d1 = log(100.0/95.0)/stdev + 0.5*stdev;
+    double d2 = d1 - stdev;
+    double pdf_d1 = exp(-0.5*d1*d1)/sqrt(2*M_PI);
+    
+    testvalue = 100.0*0.5*erfc(-d1/sqrt(2.0)) - 95.0*0.5*erfc(-d2/sqrt(2.0));
+    der = price;
+    BOOST_CHECK_SMALL(der-testvalue,0.000000000001);
+    
+    //delta
+    testvalue = 0.5*erfc(-d1/sqrt(2.0));
+    der = price.der(F);
+    BOOST_CHECK_SMALL(der-testvalue,0.000000000001);
+    
+    //vega
+    testvalue = 100.0*pdf_d1*sqrt(1.5);
+    der = price.der(sigma);
+    BOOST_CHECK_SMALL(der-testvalue,0.000000000001);
+    
+    //gamma
+    testvalue = pdf_d1/(100.0*stdev);
+    der = price.der(F,2);
+    BOOST_CHECK_SMALL(der-testvalue,0.000000000001);
+    
+    bdouble::clear_tape();
+}
+
+BOOST_AUTO_TEST_CASE(test_blackscholes_h)
+{
+    bdouble::clear_tape();
+    bdouble::setOrder(3);
+    
+    bdouble F = 100.0;
+    bdouble K = 95.0;
+    bdouble sigma = 0.2;
+    bdouble T = 1.5;
+    
+    bdouble price = blackscholes(F,K,sigma,T);
+    
+    //same formula recorded op by op
+    bdouble stdev = sigma*sqrt(T);
+    bdouble d1 = log(F/K)/stdev + stdev*0.5;
+    bdouble d2 = d1 - stdev;
+    bdouble price2 = F*N(d1) - K*N(d2);
+    
+    vector<bdouble> vars;
+    vars.push_back(F);
+    vars.push_back(K);
+    vars.push_back(sigma);
+    vars.push_back(T);
+    
+    for(size_t i = 0; i < vars.size(); i++)
+        for(size_t j = 0; j < vars.size(); j++)
+            for(size_t k = 0; k < vars.size(); k++)
+            {
+                double der = price.der(vars[i],vars[j],vars[k]);
+                double testvalue = price2.der(vars[i],vars[j],vars[k]);
+                BOOST_CHECK_SMALL(der-testvalue,0.0000000001);
+            }
+    
+    bdouble::clear_tape();
+}
+
+BOOST_AUTO_TEST_CASE(test_lognpdf_h)
+{
+    bdouble::clear_tape();
+    bdouble::setOrder(3);
+    
+    bdouble x = 1.3;
+    bdouble mu = 0.1;
+    bdouble sigma = 0.4;
+    
+    bdouble density = lognpdf(x,mu,sigma);
+    
+    //same formula recorded op by op
+    bdouble density2 = npdf((log(x)-mu)/sigma)/(x*sigma);
+    
+    BOOST_CHECK_SMALL((double)density-(double)density2,0.000000000000001);
+    
+    vector<bdouble> vars;
+    vars.push_back(x);
+    vars.push_back(mu);
+    vars.push_back(sigma);
+    
+    for(size_t i = 0; i < vars.size(); i++)
+        for(size_t j = 0; j < vars.size(); j++)
+            for(size_t k = 0; k < vars.size(); k++)
+            {
+                double der = density.der(vars[i],vars[j],vars[k]);
+                double testvalue = density2.der(vars[i],vars[j],vars[k]);
+                BOOST_CHECK_SMALL(der-testvalue,0.0000000001);
+            }
+    
+    bdouble::clear_tape();
+}
+
+BOOST_AUTO_TEST_CASE(test_fabs_fmax)
+{
+    bdouble::clear_tape();
+    bdouble::setOrder(2);
+    
+    bdouble x = -1.5;
+    bdouble y = 0.7;
+    
+    //call payoff on both sides of the strike
+    bdouble out1 = fmax(x*y - 0.2,0.0);
+    bdouble out2 = fmax(0.0,y*y - 0.2);
+    bdouble out3 = fabs(x)*y;
+    bdouble out4 = fmin(x,y)*fmax(x,y);
+    
+    BOOST_CHECK_EQUAL((double)out1,0.0);
+    BOOST_CHECK_SMALL(out1.der(x),0.000000000000001);
+    BOOST_CHECK_SMALL(out1.der(x,y),0.000000000000001);
+    
+    BOOST_CHECK_SMALL(out2.der(y)-1.4,0.000000000000001);
+    BOOST_CHECK_SMALL(out2.der(y,y)-2.0,0.000000000000001);
+    
+    BOOST_CHECK_SMALL(out3.der(x)+0.7,0.000000000000001);
+    BOOST_CHECK_SMALL(out3.der(x,y)+1.0,0.000000000000001);
+    BOOST_CHECK_SMALL(out3.der(x,x),0.000000000000001);
+    
+    BOOST_CHECK_SMALL(out4.der(x)-0.7,0.000000000000001);
+    BOOST_CHECK_SMALL(out4.der(x,y)-1.0,0.000000000000001);
+    BOOST_CHECK_SMALL(out4.der(y,y),0.000000000000001);
+    
+    bdouble::clear_tape();
+}
+
+BOOST_AUTO_TEST_CASE(test_fmax_ties)
+{
+    bdouble::clear_tape();
+    bdouble::setOrder(1);
+    
+    bdouble x = 0.5;
+    
+    //ties go to the first argument
+    bdouble out1 = fmax(x,0.5);
+    bdouble out2 = fmax(0.5,x);
+    bdouble out3 = fmin(x,0.5);
+    bdouble out4 = fmin(0.5,x);
+    
+    BOOST_CHECK_EQUAL(out1.der(x),1.0);
+    BOOST_CHECK_EQUAL(out2.der(x),0.0);
+    BOOST_CHECK_EQUAL(out3.der(x),1.0);
+    BOOST_CHECK_EQUAL(out4.der(x),0.0);
+    BOOST_CHECK_EQUAL((double)out2,0.5);
+    
+    bdouble::clear_tape();
+}
+
+BOOST_AUTO_TEST_CASE(test_select_h)
+{
+    bdouble::clear_tape();
+    bdouble::setOrder(3);
+    
+    bdouble barrier = 1.0;
+    bdouble x = 1.2;
+    bdouble y = 0.5;
+    
+    bdouble out = select(x - barrier,x*x*y,y*y);
+    
+    BOOST_CHECK_SMALL((double)out-1.2*1.2*0.5,0.000000000000001);
+    BOOST_CHECK_SMALL(out.der(x)-1.2,0.000000000000001);
+    BOOST_CHECK_SMALL(out.der(x,x,y)-2.0,0.000000000000001);
+    BOOST_CHECK_SMALL(out.der(y,y),0.000000000000001);
+    BOOST_CHECK_SMALL(out.der(barrier),0.000000000000001);
+    
+    bdouble::clear_tape();
+}
+
+BOOST_AUTO_TEST_CASE(test_smooth_h)
+{
+    bdouble::clear_tape();
+    bdouble::setOrder(4);
+    
+    bdouble x = 0.3;
+    bdouble y = -0.2;
+    double eps = 0.5;
+    
+    bdouble out1 = smoothmax(x,y,eps);
+    bdouble out2 = smoothselect(x,x*y,y,eps);
+    
+    //same formulas recorded op by op
+    bdouble z = x - y;
+    bdouble out12 = (x + y + sqrt(z*z + eps*eps))*0.5;
+    bdouble out22 = y + (x*y - y)*N(x/eps);
+    
+    BOOST_CHECK_SMALL((double)out1-(double)out12,0.000000000000001);
+    BOOST_CHECK_SMALL((double)out2-(double)out22,0.000000000000001);
+    
+    vector<bdouble> vars;
+    vars.push_back(x);
+    vars.push_back(y);
+    
+    for(size_t i = 0; i < vars.size(); i++)
+        for(size_t j = 0; j < vars.size(); j++)
+            for(size_t k = 0; k < vars.size(); k++)
+                for(size_t l = 0; l < vars.size(); l++)
+                {
+                    BOOST_CHECK_SMALL(out1.der(vars[i],vars[j],vars[k],vars[l])-out12.der(vars[i],vars[j],vars[k],vars[l]),0.0000000001);
+                    BOOST_CHECK_SMALL(out2.der(vars[i],vars[j],vars[k],vars[l])-out22.der(vars[i],vars[j],vars[k],vars[l]),0.0000000001);
+                }
+    
+    bdouble::clear_tape();
+}
+
+//the tables are used before main from another translation unit
+const size_t static_factorial = factorial(6);
+const size_t static_combins = combins(3,4);
+
+BOOST_AUTO_TEST_CASE(test_combins_tables)
+{
+    BOOST_CHECK_EQUAL(static_factorial,720);
+    BOOST_CHECK_EQUAL(static_combins,35);
+    
+    //tabulated values against the loop, on both
+    //sides of the table bounds
+    for(size_t k = 0; k < ADHOC_COMBINS_MAX_K + 2; k++)
+        for(size_t n = 0; n < ADHOC_COMBINS_MAX_N + 2; n += 7)
+        {
+            BOOST_CHECK_EQUAL(combins(k,n),combins_loop(k,n));
+            BOOST_CHECK_EQUAL(combins(k,k+n,true),combins_loop(k,n));
+        }
+    
+    BOOST_CHECK_EQUAL(combins(5,3,true),0);
+    BOOST_CHECK_EQUAL(combins2(10,4),210);
+    BOOST_CHECK_EQUAL(factorial(20),2432902008176640000ULL);
+    BOOST_CHECK_EQUAL(combins(40,200),numeric_limits<size_t>::max());
+    
+    //multisetcount is the position in the generator
+    vector<size_t> b;
+    multisetGenerator mg(5,6);
+    size_t pos = 0;
+    while(mg.next(b))
+    {
+        BOOST_CHECK_EQUAL(multisetcount(b,6),pos);
+        pos++;
+    }
+    BOOST_CHECK_EQUAL(pos,multisetcoeff(5,6));
+    
+    //bell numbers on both sides of the partitions table
+    size_t bell[] = {1, 1, 2, 5, 15, 52, 203, 877, 4140, 21147, 115975, 678570, 4213597,
+        27644437, 190899322, 1382958545, 10480142147ULL, 82864869804ULL, 682076806159ULL};
+    vector<partitionEntry> buffer;
+    for(size_t n = 1; n < 19; n++)
+    {
+        size_t total = 0;
+        const vector<partitionEntry>& parts = partitions(n,buffer);
+        for(size_t i = 0; i < parts.size(); i++)
+            total += parts[i].multiplicity;
+        
+        BOOST_CHECK_EQUAL(total,bell[n]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_multiset_unrank)
+{
+    size_t cases = 5;
+    size_t units = 4;
+    
+    vector<vector<size_t> > all;
+    vector<size_t> b,c;
+    multisetGenerator mg(cases,units);
+    while(mg.next(b))
+    {
+        multisetunrank(mg.rank(),cases,units,c);
+        BOOST_CHECK(b == c);
+        all.push_back(b);
+    }
+    
+    //chunks cover the whole enumeration
+    size_t chunk = 13;
+    size_t pos = 0;
+    for(size_t begin = 0; begin < all.size(); begin += chunk)
+    {
+        multisetGenerator mg_chunk(cases,units,begin,begin+chunk);
+        while(mg_chunk.next(b))
+        {
+            BOOST_CHECK_EQUAL(mg_chunk.rank(),pos);
+            BOOST_CHECK(b == all[pos]);
+            pos++;
+        }
+    }
+    BOOST_CHECK_EQUAL(pos,all.size());
+    
+    //and backwards
+    multisetGenerator mg_back(cases,units,20,40);
+    pos = 40;
+    while(mg_back.prev(b))
+    {
+        pos--;
+        BOOST_CHECK(b == all[pos]);
+    }
+    BOOST_CHECK_EQUAL(pos,20);
+}
+
+BOOST_AUTO_TEST_CASE(test_multiset_ranker)
+{
+    //units moved from the base to positions 4 and 2
+    size_t cases = 7;
+    size_t units = 5;
+    vector<size_t> positions;
+    positions.push_back(4);
+    positions.push_back(2);
+    multisetRanker ranker(cases,units,positions);
+    
+    vector<size_t> b;
+    multisetGenerator mg(cases,units);
+    while(mg.next(b))
+    {
+        if(b[2] != 0 || b[4] != 0)
+            continue;
+        
+        ranker.set(b);
+        
+        vector<size_t> c(b);
+        size_t moved[2];
+        for(moved[0] = 0; moved[0] <= b[0]; moved[0]++)
+            for(moved[1] = 0; moved[0]+moved[1] <= b[0]; moved[1]++)
+            {
+                c[0] = b[0] - moved[0] - moved[1];
+                c[4] = moved[0];
+                c[2] = moved[1];
+                BOOST_CHECK_EQUAL(ranker.rank(moved),multisetcount(c,units));
+            }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_fixed_generators)
+{
+    //same sequences as the vector based generators
+    for(size_t n = 1; n < 12; n++)
+    {
+        vector<size_t> b;
+        partitionGenerator pg(n);
+        
+        array<size_t,16> b_fixed;
+        size_t size;
+        partitionGeneratorFixed<16> pg_fixed(n);
+        
+        while(pg.next(b))
+        {
+            BOOST_CHECK(pg_fixed.next(b_fixed,size));
+            BOOST_CHECK(vector<size_t>(b_fixed.begin(),b_fixed.begin()+size) == b);
+            BOOST_CHECK_EQUAL(pg_fixed.multiplicity(b_fixed,size),pg.multiplicity(b));
+        }
+        BOOST_CHECK(!pg_fixed.next(b_fixed,size));
+        
+        partitionGeneratorDistinct pgd(n);
+        partitionGeneratorDistinctFixed<16> pgd_fixed(n);
+        while(pgd.next(b))
+        {
+            BOOST_CHECK(pgd_fixed.next(b_fixed));
+            BOOST_CHECK(vector<size_t>(b_fixed.begin(),b_fixed.begin()+n) == b);
+        }
+        BOOST_CHECK(!pgd_fixed.next(b_fixed));
+    }
+    
+    vector<size_t> b;
+    array<size_t,4> b_fixed;
+    combinationGenerator cg(3,4);
+    combinationGeneratorFixed<4> cg_fixed(3,4);
+    while(cg.next(b))
+    {
+        BOOST_CHECK(cg_fixed.next(b_fixed));
+        BOOST_CHECK(vector<size_t>(b_fixed.begin(),b_fixed.begin()+3) == b);
+    }
+    BOOST_CHECK(!cg_fixed.next(b_fixed));
+    
+    BOOST_CHECK_THROW(partitionGeneratorFixed<4>(5),std::invalid_argument);
+    BOOST_CHECK_THROW(partitionGeneratorFixed<4>(0),std::invalid_argument);
+    BOOST_CHECK_THROW(partitionGeneratorDistinctFixed<4>(5),std::invalid_argument);
+    BOOST_CHECK_THROW(combinationGeneratorFixed<4>(5,4),std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_CASE(test_coeff_memory)
+{
+    size_t bytes;
+    BOOST_CHECK(bdouble::coeff_memory(3,2,bytes));
+    BOOST_CHECK_EQUAL(bytes,10*sizeof(double) + 3*sizeof(size_t));
+    
+    //C(1000040,40) is far beyond 64 bits
+    BOOST_CHECK(!bdouble::coeff_memory(1000000,40,bytes));
+    
+    //exact results outside the tables
+    size_t count;
+    BOOST_CHECK(combins_checked(30,30,count));
+    BOOST_CHECK_EQUAL(count,118264581564861424ULL);
+    BOOST_CHECK(!combins_checked(35,35,count));
+    BOOST_CHECK(!combins_checked(40,1000000,count));
+    
+    BOOST_CHECK(bdouble::coeff_memory(400,4,bytes));
+    double estimate = bdouble::coeff_memory_estimate(400,4);
+    BOOST_CHECK_SMALL(estimate/bytes - 1,0.000001);
+    BOOST_CHECK(bdouble::coeff_memory_estimate(1000000,40) > 1e100);
+    
+    //a run that can't be addressed is rejected before allocating
+    bdouble::clear_tape();
+    vector<bdouble> vars;
+    bdouble sum = 0.0;
+    for(size_t i = 0; i < 60; i++)
+    {
+        vars.push_back(bdouble(0.1*i));
+        sum = sum + vars.back();
+    }
+    BOOST_CHECK_THROW(sum.run_tape(40),std::length_error);
+    
+    sum.run_tape(1);
+    BOOST_CHECK_EQUAL(sum.der(vars[3]),1.0);
+    bdouble::clear_tape();
+}
+
+BOOST_AUTO_TEST_CASE(test_tensor_export)
+{
+    bdouble::clear_tape();
+    bdouble::setOrder(3);
+    
+    bdouble x = 0.5;
+    bdouble y = 1.5;
+    bdouble z = -0.3;
+    bdouble unused = 2.0;
+    
+    bdouble out = exp(x*y)*sin(z) + y*y*z;
+    
+    //the order of vars doesn't have to follow the ids
+    vector<bdouble> vars;
+    vars.push_back(z);
+    vars.push_back(unused);
+    vars.push_back(x);
+    vars.push_back(y);
+    
+    vector<double> grad = out.gradient(vars);
+    BOOST_CHECK_EQUAL(grad.size(),4);
+    for(size_t i = 0; i < vars.size(); i++)
+        BOOST_CHECK_EQUAL(grad[i],out.der(vars[i]));
+    
+    vector<double> hess = out.hessian(vars);
+    BOOST_CHECK_EQUAL(hess.size(),10);
+    size_t pos = 0;
+    for(size_t i = 0; i < vars.size(); i++)
+        for(size_t j = i; j < vars.size(); j++)
+            BOOST_CHECK_EQUAL(hess[pos++],out.der(vars[i],vars[j]));
+    
+    vector<double> third = out.tensor(vars,3);
+    BOOST_CHECK_EQUAL(third.size(),20);
+    pos = 0;
+    for(size_t i = 0; i < vars.size(); i++)
+        for(size_t j = i; j < vars.size(); j++)
+            for(size_t k = j; k < vars.size(); k++)
+                BOOST_CHECK_EQUAL(third[pos++],out.der(vars[i],vars[j],vars[k]));
+    
+    BOOST_CHECK_THROW(out.tensor(vars,out.order()+1),std::invalid_argument);
+    
+    bdouble::clear_tape();
+}
+
+BOOST_AUTO_TEST_CASE(test_coeff_views)
+{
+    bdouble::clear_tape();
+    bdouble::setOrder(3);
+    
+    bdouble x = 0.5;
+    bdouble y = 1.5;
+    
+    bdouble out = exp(x*y) + y*y*y;
+    BOOST_CHECK(out.coeffs().empty());
+    out.run_tape();
+    
+    BOOST_CHECK_EQUAL(out.order(),3);
+    BOOST_CHECK_EQUAL(out.ids().size(),2);
+    BOOST_CHECK_EQUAL(out.coeffs().size(),multisetcoeff(3,3));
+    
+    //walking the coefficients in place
+    vector<size_t> idxes;
+    multisetGenerator mg(out.ids().size()+1,out.order());
+    size_t pos = 0;
+    while(mg.next(idxes))
+    {
+        vector<size_t> powers(idxes.begin()+1,idxes.end());
+        BOOST_CHECK_EQUAL(out.coeffs()[pos],out.der(out.ids(),powers));
+        pos++;
+    }
+    
+    bdouble::clear_tape();
+}
+
+void collect_adjoint(const size_t& id,const double& adjoint,void* data)
+{
+    (*(map<size_t,double>*)data)[id] = adjoint;
+}
+
+void order_adjoint(const size_t& id,const double& adjoint,void* data)
+{
+    ((vector<size_t>*)data)->push_back(id);
+}
+
+BOOST_AUTO_TEST_CASE(test_weighted_adjoints)
+{
+    bdouble::clear_tape();
+    bdouble::setOrder(1);
+    
+    bdouble x = 0.5;
+    bdouble y = 1.5;
+    bdouble z = -0.3;
+    bdouble unused = 2.0;
+    
+    vector<bdouble> outputs;
+    outputs.push_back(exp(x*y)*sin(z) + y*y*z);
+    outputs.push_back(fmax(x,z)*atan2(y,x) - log(y));
+    outputs.push_back(fma(z,x,y)/y);
+    
+    vector<double> weights;
+    weights.push_back(0.7);
+    weights.push_back(-1.3);
+    weights.push_back(2.1);
+    
+    vector<double> adj;
+    bdouble::adjoints(outputs,weights,adj);
+    
+    map<size_t,double> streamed;
+    bdouble::adjoints(outputs,weights,collect_adjoint,&streamed);
+    
+    vector<bdouble> vars;
+    vars.push_back(x);
+    vars.push_back(y);
+    vars.push_back(z);
+    
+    vector<double> expected(vars.size(),0);
+    for(size_t j = 0; j < outputs.size(); j++)
+        for(size_t i = 0; i < vars.size(); i++)
+            expected[i] += weights[j]*outputs[j].der(vars[i]);
+    
+    for(size_t i = 0; i < vars.size(); i++)
+    {
+        BOOST_CHECK_CLOSE(adj[vars[i].id()],expected[i],1e-10);
+        BOOST_CHECK_CLOSE(streamed[vars[i].id()],expected[i],1e-10);
+    }
+    
+    BOOST_CHECK_EQUAL(adj[unused.id()],0);
+    BOOST_CHECK_EQUAL(streamed.size(),3);
+    BOOST_CHECK(streamed.find(unused.id()) == streamed.end());
+    
+    //streamed from the sweep, the latest variables first
+    vector<size_t> order;
+    bdouble::adjoints(outputs,weights,order_adjoint,&order);
+    BOOST_CHECK_EQUAL(order.size(),3);
+    BOOST_CHECK_EQUAL(order[0],z.id());
+    BOOST_CHECK_EQUAL(order[2],x.id());
+    
+    weights.pop_back();
+    BOOST_CHECK_THROW(bdouble::adjoints(outputs,weights,adj),std::invalid_argument);
+    BOOST_CHECK_THROW(bdouble::adjoints(outputs,weights,collect_adjoint,&streamed),std::invalid_argument);
+    
+    bdouble::clear_tape();
+}
+
+BOOST_AUTO_TEST_CASE(test_sparse_jacobian)
+{
+    bdouble::clear_tape();
+    bdouble::setOrder(1);
+    
+    //bucketed instruments, each depends on two neighbouring inputs
+    vector<bdouble> vars;
+    for(size_t i = 0; i < 12; i++)
+        vars.push_back(0.01*(i+1));
+    
+    vector<bdouble> outputs;
+    for(size_t i = 0; i + 1 < vars.size(); i++)
+        outputs.push_back(exp(vars[i]*(-1.0-i))*vars[i+1] + log(1.0+vars[i+1]));
+    outputs.push_back(vars[3]);
+    
+    vector<vector<size_t> > pattern;
+    bdouble::sparsity_pattern(outputs,vars,pattern);
+    BOOST_CHECK_EQUAL(pattern.size(),outputs.size());
+    for(size_t j = 0; j + 1 < outputs.size(); j++)
+    {
+        BOOST_CHECK_EQUAL(pattern[j].size(),2);
+        BOOST_CHECK_EQUAL(pattern[j][0],j);
+        BOOST_CHECK_EQUAL(pattern[j][1],j+1);
+    }
+    BOOST_CHECK_EQUAL(pattern.back().size(),1);
+    
+    vector<size_t> colours;
+    size_t ncolours = bdouble::row_colouring(pattern,vars.size(),colours);
+    BOOST_CHECK_EQUAL(ncolours,3);
+    for(size_t j = 0; j < outputs.size(); j++)
+        for(size_t k = j+1; k < outputs.size(); k++)
+            if(colours[j] == colours[k])
+                for(size_t c = 0; c < pattern[j].size(); c++)
+                    BOOST_CHECK(find(pattern[k].begin(), pattern[k].end(), pattern[j][c]) == pattern[k].end());
+    
+    vector<size_t> rows, cols;
+    vector<double> values;
+    bdouble::sparse_jacobian(outputs,vars,rows,cols,values);
+    BOOST_CHECK_EQUAL(values.size(),2*(outputs.size()-1)+1);
+    for(size_t e = 0; e < values.size(); e++)
+    {
+        if(e > 0)
+            BOOST_CHECK(rows[e-1] < rows[e] || (rows[e-1] == rows[e] && cols[e-1] < cols[e]));
+        BOOST_CHECK_CLOSE(values[e],outputs[rows[e]].der(vars[cols[e]]),1e-10);
+    }
+    
+    bdouble::clear_tape();
+}
+
+BOOST_AUTO_TEST_CASE(test_dependencies)
+{
+    bdouble::clear_tape();
+    bdouble::setOrder(2);
+    
+    bdouble x = 0.5;
+    bdouble y = 1.5;
+    bdouble z = -0.3;
+    bdouble w = 2.0;
+    
+    bdouble other = exp(w);
+    bdouble out = x*y + sin(z)*2.0 + z*3.0 + x;
+    
+    vector<size_t> deps = out.dependencies();
+    BOOST_CHECK_EQUAL(deps.size(),3);
+    BOOST_CHECK_EQUAL(deps[0],x.id());
+    BOOST_CHECK_EQUAL(deps[1],y.id());
+    BOOST_CHECK_EQUAL(deps[2],z.id());
+    BOOST_CHECK(out.coeffs().empty());
+    
+    vector<pair<size_t,size_t> > interactions;
+    BOOST_CHECK(out.dependencies(interactions) == deps);
+    BOOST_CHECK_EQUAL(interactions.size(),2);
+    BOOST_CHECK(interactions[0] == make_pair(x.id(),y.id()));
+    BOOST_CHECK(interactions[1] == make_pair(z.id(),z.id()));
+    
+    //the pattern covers every nonzero second derivative
+    vector<bdouble> vars;
+    vars.push_back(x);
+    vars.push_back(y);
+    vars.push_back(z);
+    vector<double> hess = out.hessian(vars);
+    size_t pos = 0;
+    for(size_t i = 0; i < vars.size(); i++)
+        for(size_t j = i; j < vars.size(); j++)
+            if(hess[pos++] != 0)
+                BOOST_CHECK(find(interactions.begin(), interactions.end(), make_pair(vars[i].id(),vars[j].id())) != interactions.end());
+    
+    deps = w.dependencies(interactions);
+    BOOST_CHECK_EQUAL(deps.size(),1);
+    BOOST_CHECK_EQUAL(deps[0],w.id());
+    BOOST_CHECK(interactions.empty());
+    BOOST_CHECK(other.dependencies() == w.dependencies());
+    
+    bdouble::clear_tape();
+}
+
+BOOST_AUTO_TEST_CASE(test_chunked_vector)
+{
+    chunkedVector<size_t> v;
+    size_t n = 3*chunkedVector<size_t>::chunk_size + 1;
+    for(size_t i = 0; i < n; i++)
+    {
+        v.push_back(i);
+        BOOST_CHECK_EQUAL(v.back(),i);
+    }
+    BOOST_CHECK_EQUAL(v.size(),n);
+    BOOST_CHECK_EQUAL(v.capacity(),4*chunkedVector<size_t>::chunk_size);
+    
+    size_t i = 0;
+    for(chunkedVector<size_t>::const_iterator it = v.begin(); it != v.end(); ++it)
+        BOOST_CHECK_EQUAL(*it,i++);
+    BOOST_CHECK_EQUAL(i,n);
+    
+    for(chunkedVector<size_t>::const_reverse_iterator it = v.rbegin(); it != v.rend(); ++it)
+        BOOST_CHECK_EQUAL(*it,--i);
+    BOOST_CHECK_EQUAL(i,0);
+    
+    //jumps across chunks
+    chunkedVector<size_t>::const_reverse_iterator rit = v.rbegin();
+    rit += chunkedVector<size_t>::chunk_size + 7;
+    BOOST_CHECK_EQUAL(*rit,n - chunkedVector<size_t>::chunk_size - 8);
+    BOOST_CHECK_EQUAL(v[chunkedVector<size_t>::chunk_size],chunkedVector<size_t>::chunk_size);
+    BOOST_CHECK_EQUAL(*(v.begin() + 2*chunkedVector<size_t>::chunk_size - 1),2*chunkedVector<size_t>::chunk_size - 1);
+    
+    //clear keeps the chunks
+    v.clear();
+    BOOST_CHECK(v.empty());
+    BOOST_CHECK(v.begin() == v.end());
+    BOOST_CHECK_EQUAL(v.capacity(),4*chunkedVector<size_t>::chunk_size);
+    v.push_back(42);
+    BOOST_CHECK_EQUAL(*v.rbegin(),42);
+    
+    v.release();
+    BOOST_CHECK_EQUAL(v.capacity(),0);
+}
+
+BOOST_AUTO_TEST_CASE(test_long_tape)
+{
+    bdouble::clear_tape();
+    bdouble::setOrder(2);
+    
+    //enough ops to span several chunks of every trace
+    bdouble x = 0.3;
+    bdouble y = 0.7;
+    bdouble acc = x;
+    size_t n = chunkedVector<size_t>::chunk_size/2;
+    for(size_t i = 0; i < n; i++)
+        acc = acc*y*(1.0/0.7) + sin(x)*1e-6;
+    
+    acc.run_tape();
+    
+    double s = 1e-6*n;
+    BOOST_CHECK_CLOSE(acc.der(x),1+s*cos(0.3),1e-8);
+    BOOST_CHECK_CLOSE(acc.der(x,x),-s*sin(0.3),1e-6);
+    
+    bdouble::release_tape();
+}
+
+BOOST_AUTO_TEST_CASE(test_tape_stats)
+{
+    bdouble::clear_tape();
+    bdouble::setOrder(2);
+    
+    bdouble x = 0.5;
+    bdouble y = 1.5;
+    bdouble xy = x*y;
+    bdouble out = xy + sin(x);
+    out.run_tape();
+    
+    tapeStats stats = bdouble::tape_stats();
+    BOOST_CHECK_EQUAL(stats.ops,3);
+    BOOST_CHECK_EQUAL(stats.indices,8);
+    BOOST_CHECK_EQUAL(stats.values,4);
+    BOOST_CHECK_EQUAL(stats.ids,5);
+    BOOST_CHECK_EQUAL(stats.max_nvar,2);
+    BOOST_CHECK_EQUAL(stats.op_counts.size(),opcount);
+    BOOST_CHECK_EQUAL(stats.op_counts[bmultv],1);
+    BOOST_CHECK_EQUAL(stats.op_counts[sinv],1);
+    BOOST_CHECK_EQUAL(stats.op_counts[bplusv],1);
+    BOOST_CHECK_EQUAL(stats.op_counts[expv],0);
+    
+    //the same run recorded again on a reserved tape
+    bdouble::release_tape();
+    bdouble::reserve_tape(stats);
+    x = 0.5;
+    y = 1.5;
+    xy = x*y;
+    out = xy + sin(x);
+    tapeStats again = bdouble::tape_stats();
+    BOOST_CHECK_EQUAL(again.ops,stats.ops);
+    BOOST_CHECK_EQUAL(again.indices,stats.indices);
+    BOOST_CHECK_EQUAL(again.values,stats.values);
+    BOOST_CHECK(again.op_counts == stats.op_counts);
+    
+    out.run_tape();
+    BOOST_CHECK_EQUAL(out.der(x,y),1);
+    
+    bdouble::clear_tape();
+}
+
+BOOST_AUTO_TEST_CASE(test_mapped_tape)
+{
+    bdouble::map_tape("test_mapped_tape");
+    bdouble::setOrder(2);
+    
+    bdouble x = 0.3;
+    bdouble y = 0.7;
+    bdouble acc = x;
+    size_t n = chunkedVector<size_t>::chunk_size/2;
+    for(size_t i = 0; i < n; i++)
+        acc = acc*y*(1.0/0.7) + sin(x)*1e-6;
+    
+    acc.run_tape();
+    
+    double s = 1e-6*n;
+    BOOST_CHECK_CLOSE(acc.der(x),1+s*cos(0.3),1e-8);
+    BOOST_CHECK_CLOSE(acc.der(x,x),-s*sin(0.3),1e-6);
+    
+    //the mapped chunks are reused after clear_tape
+    bdouble::clear_tape();
+    bdouble a = 2.0;
+    bdouble b = exp(a)*a;
+    BOOST_CHECK_CLOSE(b.der(a),3*exp(2.0),1e-10);
+    
+    //mapped chunks are written in place, they can't be packed
+    BOOST_CHECK_THROW(bdouble::pack_tape(true),std::logic_error);
+    
+    bdouble::release_tape();
+    remove("test_mapped_tape.ops");
+    remove("test_mapped_tape.idx");
+    remove("test_mapped_tape.val");
+}
+
+BOOST_AUTO_TEST_CASE(test_mapped_extents)
+{
+    //enough chunks for several extents
+    size_t n = 40*chunkedVector<double>::chunk_size + 5;
+    
+    chunkedVector<double> vec;
+    vec.map_file("test_mapped_extents");
+    BOOST_CHECK(vec.mapped());
+    for(size_t i = 0; i < n; i++)
+        vec.push_back(double(i));
+    
+    size_t mismatches = 0;
+    for(size_t i = 0; i < n; i++)
+        mismatches += vec[i] != double(i);
+    BOOST_CHECK_EQUAL(mismatches,0);
+    
+    //the vector has to be released first
+    BOOST_CHECK_THROW(vec.map_file("test_mapped_extents"),std::logic_error);
+    vec.release();
+    remove("test_mapped_extents");
+    
+    BOOST_CHECK_THROW(vec.map_file("no_such_directory/test_mapped_extents"),std::system_error);
+    
+    //the tape stays in memory
+    BOOST_CHECK_THROW(bdouble::map_tape("no_such_directory/test_mapped_extents"),std::system_error);
+    bdouble x = 1.5;
+    bdouble y = x*x;
+    BOOST_CHECK_CLOSE(y.der(x),3.0,1e-10);
+    bdouble::clear_tape();
+}
+
+BOOST_AUTO_TEST_CASE(test_packed_chunks)
+{
+    vector<size_t> ids;
+    for(size_t i = 0; i < 1000; i++)
+        ids.push_back(i % 3 == 0 ? i*7 : 1000 - i);
+    ids.push_back(size_t(-1));
+    ids.push_back(0);
+    
+    vector<unsigned char> bytes;
+    pack_chunk(ids.data(),ids.size(),bytes);
+    vector<size_t> ids_back(ids.size());
+    unpack_chunk(bytes,ids.size(),ids_back.data());
+    BOOST_CHECK(ids_back == ids);
+    
+    vector<double> values;
+    for(size_t i = 0; i < 1000; i++)
+        values.push_back(i % 4 == 0 ? 0.5 : sin(double(i)));
+    values.push_back(-0.0);
+    values.push_back(0.0);
+    
+    pack_chunk(values.data(),values.size(),bytes);
+    BOOST_CHECK(bytes.size() < values.size()*sizeof(double));
+    vector<double> values_back(values.size());
+    unpack_chunk(bytes,values.size(),values_back.data());
+    BOOST_CHECK(memcmp(values.data(),values_back.data(),values.size()*sizeof(double)) == 0);
+    
+    //packed vector read forward, backward and at random
+    chunkedVector<size_t> v;
+    v.pack(true);
+    size_t n = 5*chunkedVector<size_t>::chunk_size + 3;
+    for(size_t i = 0; i < n; i++)
+        v.push_back(i/2);
+    BOOST_CHECK(v.bytes() < n*sizeof(size_t)/2);
+    
+    size_t i = 0;
+    for(chunkedVector<size_t>::const_iterator it = v.begin(); it != v.end(); ++it)
+        BOOST_CHECK_EQUAL(*it,(i++)/2);
+    for(chunkedVector<size_t>::const_reverse_iterator it = v.rbegin(); it != v.rend(); ++it)
+        BOOST_CHECK_EQUAL(*it,(--i)/2);
+    BOOST_CHECK_EQUAL(v[chunkedVector<size_t>::chunk_size+1],(chunkedVector<size_t>::chunk_size+1)/2);
+    
+    //the buffers are reused by the next recording
+    v.clear();
+    for(size_t i = 0; i < n; i++)
+        v.push_back(n-i);
+    i = 0;
+    for(chunkedVector<size_t>::const_iterator it = v.begin(); it != v.end(); ++it)
+        BOOST_CHECK_EQUAL(*it,n-(i++));
+}
+
+BOOST_AUTO_TEST_CASE(test_packed_tape)
+{
+    bdouble::release_tape();
+    bdouble::pack_tape(true);
+    bdouble::setOrder(2);
+    
+    bdouble x = 0.3;
+    bdouble y = 0.7;
+    bdouble acc = x;
+    size_t n = chunkedVector<size_t>::chunk_size/2;
+    for(size_t i = 0; i < n; i++)
+        acc = acc*y*(1.0/0.7) + sin(x)*1e-6;
+    
+    tapeStats stats = bdouble::tape_stats();
+    BOOST_CHECK(stats.bytes < (stats.ops + stats.indices + stats.values)*sizeof(double));
+    
+    acc.run_tape();
+    
+    double s = 1e-6*n;
+    BOOST_CHECK_CLOSE(acc.der(x),1+s*cos(0.3),1e-8);
+    BOOST_CHECK_CLOSE(acc.der(x,x),-s*sin(0.3),1e-6);
+    
+    vector<bdouble> outputs(1,acc);
+    vector<double> weights(1,1.0);
+    vector<double> adj;
+    bdouble::adjoints(outputs,weights,adj);
+    BOOST_CHECK_CLOSE(adj[x.id()],acc.der(x),1e-10);
+    BOOST_CHECK(acc.dependencies().size() == 2);
+    
+    bdouble::pack_tape(false);
+    bdouble::release_tape();
+}
+
+BOOST_AUTO_TEST_CASE(test_save_load_tape)
+{
+    bdouble::clear_tape();
+    
+    bdouble x = 0.3;
+    bdouble y = 0.7;
+    bdouble acc = x;
+    size_t n = chunkedVector<size_t>::chunk_size/2 + 3;
+    for(size_t i = 0; i < n; i++)
+        acc = acc*y*(1.0/0.7) + sin(x)*exp(y)*1e-6;
+    
+    acc.run_tape(3);
+    double dx = acc.der(x);
+    double dxy = acc.der(x,y);
+    double dxxy = acc.der(x,x,y);
+    
+    vector<bdouble> vars;
+    vars.push_back(x);
+    vars.push_back(y);
+    vars.push_back(acc);
+    bdouble::save_tape("test_save_load_tape.bin",vars);
+    
+    for(size_t map = 0; map < 2; map++)
+    {
+        vector<bdouble> loaded = bdouble::load_tape("test_save_load_tape.bin",map == 1);
+        BOOST_CHECK_EQUAL(loaded.size(),3);
+        BOOST_CHECK_EQUAL(loaded[0].id(),x.id());
+        BOOST_CHECK_EQUAL(loaded[2].id(),acc.id());
+        BOOST_CHECK_EQUAL((double)loaded[2],(double)acc);
+        
+        //a different order than the one recorded for
+        loaded[2].run_tape(2);
+        BOOST_CHECK_CLOSE(loaded[2].der(loaded[0]),dx,1e-10);
+        BOOST_CHECK_CLOSE(loaded[2].der(loaded[0],loaded[1]),dxy,1e-10);
+        
+        loaded[2].run_tape(3);
+        BOOST_CHECK_CLOSE(loaded[2].der(loaded[0],loaded[0],loaded[1]),dxxy,1e-10);
+        
+        //recording goes on after the loaded ops
+        bdouble more = loaded[2]*loaded[1];
+        more.run_tape(1);
+        BOOST_CHECK_CLOSE(more.der(loaded[0]),dx*0.7,1e-10);
+    }
+    
+    bdouble::clear_tape();
+    remove("test_save_load_tape.bin");
+}
+
+BOOST_AUTO_TEST_CASE(test_load_tape_errors)
+{
+    bdouble::release_tape();
+    
+    bdouble x = 0.3;
+    bdouble y = 0.7;
+    bdouble out = x*y + sin(x);
+    
+    vector<bdouble> vars;
+    vars.push_back(x);
+    vars.push_back(y);
+    vars.push_back(out);
+    bdouble::save_tape("test_load_tape_errors.bin",vars);
+    
+    std::ifstream in("test_load_tape_errors.bin",std::ios::binary);
+    string saved((std::istreambuf_iterator<char>(in)),std::istreambuf_iterator<char>());
+    in.close();
+    
+    //64 bytes of header, 3 variables, then 3 ops and their indices
+    vector<string> corrupt;
+    corrupt.push_back(saved.substr(0,saved.size()-8));
+    corrupt.push_back(saved.substr(0,40));
+    corrupt.push_back(saved);
+    corrupt.back()[0] = 'X';
+    corrupt.push_back(saved);
+    corrupt.back()[8] = 99;
+    corrupt.push_back(saved);
+    uint64_t huge = uint64_t(1) << 60;
+    memcpy(&corrupt.back()[56],&huge,sizeof(huge));
+    corrupt.push_back(saved);
+    uint64_t bad = 1000;
+    memcpy(&corrupt.back()[64],&bad,sizeof(bad));
+    corrupt.push_back(saved);
+    memcpy(&corrupt.back()[112],&bad,sizeof(bad));
+    corrupt.push_back(saved);
+    memcpy(&corrupt.back()[136],&bad,sizeof(bad));
+    
+    for(size_t i = 0; i < corrupt.size(); i++)
+    {
+        std::ofstream file("test_load_tape_errors.bad",std::ios::binary);
+        file.write(corrupt[i].data(),corrupt[i].size());
+        file.close();
+        
+        for(size_t map = 0; map < 2; map++)
+        {
+            BOOST_CHECK_THROW(bdouble::load_tape("test_load_tape_errors.bad",map == 1),std::runtime_error);
+            BOOST_CHECK_EQUAL(bdouble::tape_stats().ops,0);
+        }
+    }
+    
+    BOOST_CHECK_THROW(bdouble::load_tape("no_such_file.bin"),std::runtime_error);
+    BOOST_CHECK_THROW(bdouble::save_tape("no_such_directory/test.bin",vars),std::runtime_error);
+    
+    //the saved file still loads
+    vector<bdouble> loaded = bdouble::load_tape("test_load_tape_errors.bin");
+    loaded[2].run_tape(1);
+    BOOST_CHECK_CLOSE(loaded[2].der(loaded[0]),0.7+cos(0.3),1e-10);
+    
+    bdouble::clear_tape();
+    remove("test_load_tape_errors.bin");
+    remove("test_load_tape_errors.bad");
+}
+
+BOOST_AUTO_TEST_CASE(test_rewind_tape)
+{
+    for(size_t pack = 0; pack < 2; pack++)
+    {
+        bdouble::release_tape();
+        bdouble::pack_tape(pack == 1);
+        bdouble::setOrder(2);
+        
+        //a prefix spanning several chunks
+        bdouble r = 0.01;
+        bdouble curve = r;
+        size_t n = chunkedVector<size_t>::chunk_size/8 + 5;
+        for(size_t i = 0; i < n; i++)
+            curve = curve*0.5 + r*0.5;
+        
+        tapePosition position = bdouble::tape_position();
+        
+        for(size_t trade = 1; trade <= 3; trade++)
+        {
+            bdouble strike = 0.02*trade;
+            bdouble pv = exp(curve*(-1.0*trade))*strike;
+            
+            BOOST_CHECK_EQUAL(strike.id(),position.ids);
+            BOOST_CHECK_CLOSE(pv.der(r),-1.0*trade*exp(-0.01*trade)*0.02*trade,1e-8);
+            BOOST_CHECK_CLOSE(pv.der(r,strike),-1.0*trade*exp(-0.01*trade),1e-8);
+            
+            bdouble::rewind_tape(position);
+            tapePosition back = bdouble::tape_position();
+            BOOST_CHECK_EQUAL(back.ops,position.ops);
+            BOOST_CHECK_EQUAL(back.indices,position.indices);
+            BOOST_CHECK_EQUAL(back.values,position.values);
+            BOOST_CHECK_EQUAL(back.ids,position.ids);
+        }
+        
+        //back inside the prefix
+        tapePosition start = position;
+        start.ops = 0;
+        start.indices = 0;
+        start.values = 0;
+        start.ids = r.id()+1;
+        bdouble::rewind_tape(start);
+        bdouble twice = r*2.0;
+        BOOST_CHECK_EQUAL(twice.der(r),2);
+    }
+    
+    bdouble::pack_tape(false);
+    bdouble::release_tape();
+}
+
+BOOST_AUTO_TEST_CASE(test_rewind_tape_errors)
+{
+    bdouble::clear_tape();
+    
+    bdouble x = 0.3;
+    bdouble y = sin(x);
+    tapePosition position = bdouble::tape_position();
+    
+    //past the end of the tape
+    tapePosition past = position;
+    past.values++;
+    BOOST_CHECK_THROW(bdouble::rewind_tape(past),std::invalid_argument);
+    past = position;
+    past.ids++;
+    BOOST_CHECK_THROW(bdouble::rewind_tape(past),std::invalid_argument);
+    
+    chunkedVector<size_t> trace;
+    trace.push_back(1);
+    BOOST_CHECK_THROW(trace.truncate(2),std::invalid_argument);
+    
+    //positions don't survive the tape being replaced
+    vector<bdouble> vars(1,y);
+    bdouble::optimize_tape(vars);
+    BOOST_CHECK_THROW(bdouble::rewind_tape(position),std::invalid_argument);
+    
+    position = bdouble::tape_position();
+    bdouble::clear_tape();
+    BOOST_CHECK_THROW(bdouble::rewind_tape(position),std::invalid_argument);
+    
+    position = bdouble::tape_position();
+    bdouble::rewind_tape(position);
+    
+    bdouble::clear_tape();
+}
+
+BOOST_AUTO_TEST_CASE(test_tape_prefix)
+{
+    bdouble::clear_tape();
+    bdouble::setOrder(1);
+    
+    //a toy bootstrap, each node depends on the quotes up to it
+    vector<bdouble> quotes;
+    for(size_t j = 0; j < 5; j++)
+        quotes.push_back(0.01 + 0.002*j);
+    
+    vector<bdouble> nodes;
+    bdouble sum = quotes[0];
+    nodes.push_back(exp(sum*(-1.0)));
+    for(size_t j = 1; j < quotes.size(); j++)
+    {
+        sum = sum + quotes[j];
+        nodes.push_back(exp(sum*(-1.0-j)));
+    }
+    //a quote used as a node is not counted twice
+    nodes.push_back(quotes[2]);
+    
+    tapePrefix prefix(nodes,quotes);
+    tapePosition position = prefix.position();
+    
+    for(size_t trade = 0; trade < 3; trade++)
+    {
+        //uses the nodes and one quote directly
+        bdouble pv = nodes[trade]*nodes[trade+2]*(1.0+trade) + log(quotes[trade+1]) + nodes.back()*3.0;
+        
+        vector<double> grad = prefix.gradient(pv);
+        BOOST_CHECK_EQUAL(grad.size(),quotes.size());
+        
+        //the buffers of the prefix are clean for the next call
+        BOOST_CHECK(prefix.gradient(pv) == grad);
+        
+        //against a sweep of the whole tape
+        vector<double> adj;
+        bdouble::adjoints(vector<bdouble>(1,pv),vector<double>(1,1.0),adj);
+        for(size_t j = 0; j < quotes.size(); j++)
+            BOOST_CHECK_CLOSE(grad[j],adj[quotes[j].id()],1e-10);
+        
+        bdouble::rewind_tape(position);
+    }
+    
+    bdouble::clear_tape();
+}
+
+BOOST_AUTO_TEST_CASE(test_optimize_tape)
+{
+    bdouble::clear_tape();
+    
+    bdouble unused = 4.0;
+    bdouble x = 0.3;
+    bdouble y = 0.7;
+    
+    bdouble a = x*2.0;
+    bdouble b = a*3.0;
+    bdouble c = b + 1.0;
+    bdouble d = 5.0 - c;
+    bdouble dead = exp(x)*y;
+    bdouble e = d*y;
+    bdouble out = e + sin(a);
+    BOOST_CHECK_EQUAL(bdouble::tape_stats().ops,9);
+    
+    vector<bdouble> vars;
+    vars.push_back(x);
+    vars.push_back(y);
+    vars.push_back(out);
+    
+    out.run_tape(3);
+    double dx = out.der(x);
+    double dxy = out.der(x,y);
+    double dxxx = out.der(x,x,x);
+    
+    bdouble::optimize_tape(vars);
+    
+    //a, d from x with the factor -6, d*y, sin(a) and the sum
+    tapeStats stats = bdouble::tape_stats();
+    BOOST_CHECK_EQUAL(stats.ops,5);
+    BOOST_CHECK_EQUAL(stats.op_counts[multconstv],2);
+    BOOST_CHECK_EQUAL(stats.op_counts[expv],0);
+    BOOST_CHECK_EQUAL(stats.ids,7);
+    BOOST_CHECK_EQUAL((double)vars[2],(double)out);
+    
+    vars[2].run_tape(3);
+    BOOST_CHECK_CLOSE(vars[2].der(vars[0]),dx,1e-10);
+    BOOST_CHECK_CLOSE(vars[2].der(vars[0],vars[1]),dxy,1e-10);
+    BOOST_CHECK_CLOSE(vars[2].der(vars[0],vars[0],vars[0]),dxxx,1e-10);
+    
+    bdouble::clear_tape();
+}
+
+BOOST_AUTO_TEST_CASE(test_tape_cse)
+{
+    bdouble::clear_tape();
+    
+    bdouble S = 100.0;
+    bdouble K = 95.0;
+    bdouble T = 2.0;
+    
+    bdouble d1 = log(S/K)/sqrt(T);
+    bdouble d2 = log(S/K)/sqrt(T) - sqrt(T)*0.2;
+    bdouble out = S*N(d1) - K*N(d2) + K*S - S*K;
+    size_t ops = bdouble::tape_stats().ops;
+    
+    vector<bdouble> vars;
+    vars.push_back(S);
+    vars.push_back(K);
+    vars.push_back(T);
+    vars.push_back(out);
+    
+    out.run_tape(2);
+    double dS = out.der(S);
+    double dST = out.der(S,T);
+    double dKK = out.der(K,K);
+    
+    bdouble::optimize_tape(vars);
+    
+    //log(S/K)/sqrt(T) is six ops recorded twice, sqrt(T) a third
+    //time and K*S and S*K are the same product
+    BOOST_CHECK_EQUAL(bdouble::tape_stats().ops,ops-8);
+    BOOST_CHECK_EQUAL(bdouble::tape_stats().op_counts[logv],1);
+    BOOST_CHECK_EQUAL((double)vars[3],(double)out);
+    
+    vars[3].run_tape(2);
+    BOOST_CHECK_CLOSE(vars[3].der(vars[0]),dS,1e-10);
+    BOOST_CHECK_CLOSE(vars[3].der(vars[0],vars[2]),dST,1e-10);
+    BOOST_CHECK_CLOSE(vars[3].der(vars[1],vars[1]),dKK,1e-10);
+    
+    bdouble::clear_tape();
+}
+
+BOOST_AUTO_TEST_CASE(test_record_rules)
+{
+    bdouble::clear_tape();
+    
+    bdouble x = 1.3;
+    bdouble y = 0.4;
+    
+    //none of these reach the tape
+    bdouble zero = x*0.0;
+    bdouble diff = y - y;
+    bdouble same = pow(x,1);
+    bdouble samed = pow(y,1.0);
+    BOOST_CHECK_EQUAL(bdouble::tape_stats().ops,0);
+    BOOST_CHECK_EQUAL((double)zero,0.0);
+    BOOST_CHECK_EQUAL((double)diff,0.0);
+    BOOST_CHECK_EQUAL(same.id(),x.id());
+    BOOST_CHECK_EQUAL(samed.id(),y.id());
+    
+    bdouble l = log(x);
+    bdouble el = exp(l);
+    BOOST_CHECK_EQUAL(el.id(),x.id());
+    BOOST_CHECK_CLOSE((double)el,1.3,1e-12);
+    
+    bdouble i = inv(y);
+    bdouble ii = inv(i);
+    BOOST_CHECK_EQUAL(ii.id(),y.id());
+    BOOST_CHECK_EQUAL(bdouble::tape_stats().op_counts[expv],0);
+    BOOST_CHECK_EQUAL(bdouble::tape_stats().op_counts[invv],1);
+    
+    //the second product is taken directly on x
+    bdouble a = x*2.0;
+    bdouble b = a*3.0;
+    bdouble out = b*y + el*ii + zero*diff + sin(a);
+    BOOST_CHECK_CLOSE((double)b,7.8,1e-12);
+    
+    out.run_tape(3);
+    BOOST_CHECK_CLOSE(out.der(x),6*0.4 + 0.4 + 2*cos(2.6),1e-10);
+    BOOST_CHECK_CLOSE(out.der(x,y),7.0,1e-10);
+    BOOST_CHECK_CLOSE(out.der(x,x,x),-8*cos(2.6),1e-10);
+    BOOST_CHECK_SMALL(out.der(y,y),1e-12);
+    
+    bdouble::clear_tape();
+}
+
+BOOST_AUTO_TEST_CASE(test_record_rules_prefix)
+{
+    bdouble::clear_tape();
+    bdouble::setOrder(1);
+    
+    //a multconst node is not folded into the suffix
+    bdouble q1 = 0.01;
+    bdouble q2 = 0.02;
+    bdouble z = q1 + q2;
+    bdouble node = z*0.5;
+    
+    tapePrefix prefix(vector<bdouble>(1,node),{q1,q2});
+    vector<double> grad = prefix.gradient(node*3.0);
+    BOOST_CHECK_CLOSE(grad[0],1.5,1e-12);
+    BOOST_CHECK_CLOSE(grad[1],1.5,1e-12);
+    
+    //neither is a log node
+    bdouble::clear_tape();
+    
+    bdouble a = 1.0;
+    bdouble b = 2.0;
+    bdouble n = log(a*b);
+    
+    tapePrefix log_prefix(vector<bdouble>(1,n),{a,b});
+    grad = log_prefix.gradient(exp(n));
+    BOOST_CHECK_CLOSE(grad[0],2.0,1e-12);
+    BOOST_CHECK_CLOSE(grad[1],1.0,1e-12);
+    
+    //past the position exp(log(x)) is x, with its own value
+    bdouble::clear_tape();
+    
+    bdouble x = 0.3;
+    tapePosition position = bdouble::tape_position();
+    bdouble l = log(x);
+    bdouble el = exp(l);
+    BOOST_CHECK_EQUAL(el.id(),x.id());
+    BOOST_CHECK_EQUAL((double)el,0.3);
+    
+    //a rewind drops the later positions
+    bdouble::rewind_tape(position);
+    bdouble y = sin(x);
+    bdouble::tape_position();
+    bdouble::rewind_tape(position);
+    bdouble ly = log(x);
+    BOOST_CHECK_EQUAL(exp(ly).id(),x.id());
+    
+    //outside of the domains nothing is simplified
+    bdouble::clear_tape();
+    
+    bdouble neg = -0.5;
+    bdouble eneg = exp(log(neg));
+    BOOST_CHECK(eneg.id() != neg.id());
+    BOOST_CHECK(std::isnan((double)eneg));
+    eneg.run_tape(1);
+    BOOST_CHECK(std::isnan(eneg.der(neg)));
+    
+    bdouble zero = 0.0;
+    bdouble izero = inv(inv(zero));
+    BOOST_CHECK(izero.id() != zero.id());
+    izero.run_tape(1);
+    BOOST_CHECK(std::isnan(izero.der(zero)));
+    
+    bdouble::clear_tape();
+}